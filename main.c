@@ -5,6 +5,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
@@ -12,6 +13,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <termios.h>
@@ -214,6 +217,38 @@ fatal:
     return -1;
 }
 
+/* Translate the button code of a mouse report into a key. SGR reports
+ * flag releases separately; the older protocols report any release as
+ * button 3, which we take as the left button, the only one we use. */
+int termMouseKey(int type, int release) {
+    switch (type) {
+    case 0:
+        return release ? LMB_UP : LMB_DOWN;
+    case 1:
+        return release ? MMB_UP : MMB_DOWN;
+    case 2:
+        return release ? RMB_UP : RMB_DOWN;
+    case 3:
+        return LMB_UP;
+    case 32:
+        if (!release) return LMB_PRESSED_MOVE;
+        break;
+    case 33:
+        if (!release) return MMB_PRESSED_MOVE;
+        break;
+    case 34:
+        if (!release) return RMB_PRESSED_MOVE;
+        break;
+    case 35:
+        return MOUSE_MOVE;
+    case 64:
+        return SCROLL_UP;
+    case 65:
+        return SCROLL_DOWN;
+    }
+    return ESC;
+}
+
 /* Read a key from the terminal put in raw mode, trying to handle
  * escape sequences. */
 int termReadKey(int fd) {
@@ -230,9 +265,15 @@ int termReadKey(int fd) {
         /* ESC [ sequences. */
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {
-                /* Extended escape, read additional byte. */
-                if (read(fd, seq + 2, 1) == 0) return ESC;
-                if (seq[2] == '~') {
+                /* Extended escape, read up to the final byte. */
+                int i = 2, type, x, y;
+                while (1) {
+                    if (read(fd, seq + i, 1) == 0) return ESC;
+                    if (seq[i] >= 0x40 && seq[i] <= 0x7e) break;
+                    if (++i == 31) return ESC;
+                }
+                seq[i + 1] = '\0';
+                if (i == 2 && seq[2] == '~') {
                     switch (seq[1]) {
                     case '3':
                         return DEL_KEY;
@@ -241,7 +282,24 @@ int termReadKey(int fd) {
                     case '6':
                         return PAGE_DOWN;
                     }
+                } else if (seq[i] == 'M' && sscanf(seq + 1, "%d;%d;%d", &type, &x, &y) == 3) {
+                    /* urxvt mouse report: ESC [ button+32 ; x ; y M */
+                    MOUSEX = x;
+                    MOUSEY = y;
+                    return termMouseKey(type - 32, 0);
+                } else if (seq[i] == 'R') {
+                    /* Cursor position report answering a probe that timed out. */
+                    return KEY_NULL;
+                }
+            } else if (seq[1] == '?') {
+                /* Late DECRPM reply, ESC [ ? mode ; state $ y: drop it. */
+                int i = 2;
+                while (i < 31) {
+                    if (read(fd, seq + i, 1) == 0) break;
+                    if (seq[i] >= 0x40 && seq[i] <= 0x7e) break;
+                    i++;
                 }
+                return KEY_NULL;
             } else if (seq[1] == '<') {
                 int i = 2;
                 while (i < 31) {
@@ -251,50 +309,20 @@ int termReadKey(int fd) {
                 }
 
                 seq[i + 1] = '\0';
-                int type, x, y;
+                int type = -1, x, y;
                 if (sscanf(seq + 1, "<%d;%d;%d", &type, &x, &y) == 3) {
                     MOUSEX = x;
                     MOUSEY = y;
                 }
-                switch (type) {
-                case 0:
-                    if (seq[i] == 'M')
-                        return LMB_DOWN;
-                    else if (seq[i] == 'm')
-                        return LMB_UP;
-                    break;
-                case 1:
-                    if (seq[i] == 'M')
-                        return MMB_DOWN;
-                    else if (seq[i] == 'm')
-                        return MMB_UP;
-                    break;
-                case 2:
-                    if (seq[i] == 'M')
-                        return RMB_DOWN;
-                    else if (seq[i] == 'm')
-                        return RMB_UP;
-                    break;
-                case 32:
-                    if (seq[i] == 'M')
-                        return LMB_PRESSED_MOVE;
-                    break;
-                case 33:
-                    if (seq[i] == 'M')
-                        return MMB_PRESSED_MOVE;
-                    break;
-                case 34:
-                    if (seq[i] == 'M')
-                        return RMB_PRESSED_MOVE;
-                    break;
-                case 35:
-                    return MOUSE_MOVE;
-                case 64:
-                    return SCROLL_UP;
-                case 65:
-                    return SCROLL_DOWN;
-                }
-                return ESC;
+                return termMouseKey(type, seq[i] == 'm');
+            } else if (seq[1] == 'M') {
+                /* X10 mouse report: ESC [ M button+32 x+32 y+32 */
+                unsigned char b[3];
+                for (int i = 0; i < 3; i++)
+                    if (read(fd, b + i, 1) == 0) return ESC;
+                MOUSEX = b[1] - 32;
+                MOUSEY = b[2] - 32;
+                return termMouseKey(b[0] - 32, 0);
             } else {
                 switch (seq[1]) {
                 case 'A':
@@ -313,6 +341,17 @@ int termReadKey(int fd) {
             }
         }
 
+        /* Late DCS reply, ESC P ... ESC \: drop everything up to the ST. */
+        else if (seq[0] == 'P') {
+            char prev = seq[1];
+            for (int i = 0; i < 256; i++) {
+                if (read(fd, seq, 1) == 0) break;
+                if (prev == ESC && seq[0] == '\\') break;
+                prev = seq[0];
+            }
+            return KEY_NULL;
+        }
+
         /* ESC O sequences. */
         else if (seq[0] == 'O') {
             switch (seq[1]) {
@@ -327,24 +366,40 @@ int termReadKey(int fd) {
     return c;
 }
 
+/* Read a reply to a terminal query into buf, until the byte 'last' arrives,
+ * the buffer is full or 'timeoutMs' milliseconds have passed, so a
+ * terminal that does not answer can't hang us. The reply is null
+ * terminated; returns its length. */
+int termReadReply(int ifd, char *buf, int size, char last, int timeoutMs) {
+    struct pollfd pfd = {ifd, POLLIN, 0};
+    struct timespec start, now;
+    int i = 0, left = timeoutMs;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (i < size - 1 && left > 0) {
+        if (poll(&pfd, 1, left) > 0) {
+            if (read(ifd, buf + i, 1) != 1) break;
+            if (buf[i++] == last) break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        left = timeoutMs - ((now.tv_sec - start.tv_sec) * 1000 +
+                            (now.tv_nsec - start.tv_nsec) / 1000000);
+    }
+    buf[i] = '\0';
+    return i;
+}
+
 /* Use the ESC [6n escape sequence to query the horizontal cursor position
  * and return it. On error -1 is returned, on success the position of the
  * cursor is stored at *rows and *cols and 0 is returned. */
 int getCursorPosition(int ifd, int ofd, int *rows, int *cols) {
     char buf[32];
-    unsigned int i = 0;
 
     /* Report cursor location */
     if (write(ofd, "\x1b[6n", 4) != 4) return -1;
 
     /* Read the response: ESC [ rows ; cols R */
-    while (i < sizeof(buf) - 1) {
-        if (read(ifd, buf + i, 1) != 1) break;
-        if (buf[i] == 'R') break;
-        i++;
-    }
-
-    buf[i] = '\0';
+    termReadReply(ifd, buf, sizeof(buf), 'R', 1000);
 
     /* Parse it. */
     if (buf[0] != ESC || buf[1] != '[') return -1;
@@ -388,18 +443,406 @@ failed:
     return -1;
 }
 
+/* ======================= Terminal capabilities ====================== */
+
+/* At startup we ask the terminal what it supports: DECRQM queries for
+ * synchronized output (mode 2026) and the mouse modes, and a DECRQSS
+ * query reading back a truecolor SGR, which no terminal limited to 16
+ * colors understands. A cursor position request goes
+ * last: every terminal answers it, so once its reply arrives all the
+ * others have been answered or ignored, and we don't have to wait for the
+ * full timeout. */
+
+#define TERM_PROBE_TIMEOUT_MS 200
+
+enum MOUSE_PROTOCOL {
+    MOUSE_UNKNOWN = 0, /* No answer, enable everything and hope. */
+    MOUSE_SGR,
+    MOUSE_URXVT,
+    MOUSE_X10
+};
+
+struct termCaps {
+    int syncOutput; /* DEC mode 2026, frames are drawn atomically. */
+    int colors256;   /* 256-color palette, from TERM or a truecolor reply. */
+    int mouse;       /* MOUSE_* */
+    int anyMotion;   /* Mode 1003, motion reported without buttons. */
+};
+
+struct termCaps TERMCAPS = {0, 1, MOUSE_UNKNOWN, 1};
+
+/* The default xterm RGB values for the 16 colors of the palette. */
+unsigned char xtermPalette[16][3] = {
+    {0x00, 0x00, 0x00}, {0xcd, 0x00, 0x00}, {0x00, 0xcd, 0x00}, {0xcd, 0xcd, 0x00},
+    {0x00, 0x00, 0xee}, {0xcd, 0x00, 0xcd}, {0x00, 0xcd, 0xcd}, {0xe5, 0xe5, 0xe5},
+    {0x7f, 0x7f, 0x7f}, {0xff, 0x00, 0x00}, {0x00, 0xff, 0x00}, {0xff, 0xff, 0x00},
+    {0x5c, 0x5c, 0xff}, {0xff, 0x00, 0xff}, {0x00, 0xff, 0xff}, {0xff, 0xff, 0xff},
+};
+
+/* Return the DECRPM state reported for 'mode' in the reply buffer:
+ * 1 or 2 (set / reset) and 3 (always set) mean the mode is supported,
+ * 0 (unknown) and 4 (always reset) that it is not. -1 if not answered. */
+int termReplyMode(const char *reply, int mode) {
+    const char *p = reply;
+    int m, state;
+
+    while ((p = strstr(p, "\x1b[?")) != NULL) {
+        p += 3;
+        if (sscanf(p, "%d;%d$y", &m, &state) == 2 && m == mode) return state;
+    }
+    return -1;
+}
+
+int termModeSupported(int state) {
+    return state >= 1 && state <= 3;
+}
+
+void termProbeCapabilities(int ifd, int ofd) {
+    const char *query =
+        "\x1b[?2026$p"                     /* Synchronized output. */
+        "\x1b[?1006$p"                     /* SGR mouse reports. */
+        "\x1b[?1015$p"                     /* urxvt mouse reports. */
+        "\x1b[?1003$p"                     /* Any motion tracking. */
+        "\x1b[48;2;1;2;3m\x1bP$qm\x1b\\" /* Read back a truecolor SGR. */
+        "\x1b[0m\x1b[6n";
+    const char *env;
+    char reply[512];
+    int sgr, urxvt, motion;
+
+    env = getenv("TERM");
+    TERMCAPS.colors256 = env == NULL || strstr(env, "256") != NULL;
+    env = getenv("COLORTERM");
+    if (env && (strstr(env, "truecolor") || strstr(env, "24bit"))) TERMCAPS.colors256 = 1;
+
+    if (write(ofd, query, strlen(query)) != (ssize_t)strlen(query)) return;
+    termReadReply(ifd, reply, sizeof(reply), 'R', TERM_PROBE_TIMEOUT_MS);
+
+    TERMCAPS.syncOutput = termModeSupported(termReplyMode(reply, 2026));
+    if (strstr(reply, "48:2:1:2:3") || strstr(reply, "48;2;1;2;3") || strstr(reply, "48:2::1:2:3"))
+        TERMCAPS.colors256 = 1;
+
+    sgr = termReplyMode(reply, 1006);
+    urxvt = termReplyMode(reply, 1015);
+    motion = termReplyMode(reply, 1003);
+    if (sgr == -1 && urxvt == -1) return; /* No DECRQM, keep the defaults. */
+    if (termModeSupported(sgr))
+        TERMCAPS.mouse = MOUSE_SGR;
+    else if (termModeSupported(urxvt))
+        TERMCAPS.mouse = MOUSE_URXVT;
+    else
+        TERMCAPS.mouse = MOUSE_X10;
+    TERMCAPS.anyMotion = termModeSupported(motion);
+}
+
+/* Enable (or disable) mouse reporting with the best protocol we found. */
+void termSetMouseReporting(int enable) {
+    char seq[64];
+    int len = 0;
+
+    len += snprintf(seq + len, sizeof(seq) - len, "\x1b[?%dh", TERMCAPS.anyMotion ? 1003 : 1002);
+    if (TERMCAPS.mouse == MOUSE_SGR || TERMCAPS.mouse == MOUSE_UNKNOWN)
+        len += snprintf(seq + len, sizeof(seq) - len, "\x1b[?1006h");
+    if (TERMCAPS.mouse == MOUSE_URXVT || TERMCAPS.mouse == MOUSE_UNKNOWN)
+        len += snprintf(seq + len, sizeof(seq) - len, "\x1b[?1015h");
+    if (!enable) {
+        for (int i = 0; i < len; i++)
+            if (seq[i] == 'h') seq[i] = 'l';
+    }
+    if (write(STDOUT_FILENO, seq, len) != len) {
+        /* Nothing we can do. */
+    }
+}
+
+/* ======================= Terminal output ====================== */
+
+/* Colors are selected through termColor(), which remembers the current
+ * SGR colors so that repeating them costs nothing, and encodes each one in
+ * the shortest form the terminal supports: the 16 base colors as 30-37 /
+ * 90-97 (40-47 / 100-107 for the background), the others as 256-color
+ * indexes, or as the nearest base color on terminals that only have 16. */
+
+int termFg = -1, termBg = -1; /* -1 is the terminal default. */
+
+/* Append the SGR parameters for 'color' to 'buf'. */
+int termColorParams(char *buf, int size, int color, int bg) {
+    int r, g, b, best = 0, bestDist = -1;
+
+    if (color < 8) return snprintf(buf, size, "%d", (bg ? 40 : 30) + color);
+    if (color < 16) return snprintf(buf, size, "%d", (bg ? 100 : 90) + color - 8);
+    if (TERMCAPS.colors256) return snprintf(buf, size, "%d;5;%d", bg ? 48 : 38, color);
+
+    /* Only 16 colors: take the nearest to the RGB value of the 256-color
+     * index, a 6x6x6 cube followed by a gray ramp. */
+    if (color < 232) {
+        r = (color - 16) / 36;
+        g = (color - 16) / 6 % 6;
+        b = (color - 16) % 6;
+        r = r ? 55 + r * 40 : 0;
+        g = g ? 55 + g * 40 : 0;
+        b = b ? 55 + b * 40 : 0;
+    } else {
+        r = g = b = 8 + (color - 232) * 10;
+    }
+    for (int i = 0; i < 16; i++) {
+        int dr = r - xtermPalette[i][0], dg = g - xtermPalette[i][1], db = b - xtermPalette[i][2];
+        int dist = dr * dr + dg * dg + db * db;
+        if (bestDist == -1 || dist < bestDist) {
+            best = i;
+            bestDist = dist;
+        }
+    }
+    return termColorParams(buf, size, best, bg);
+}
+
+/* Switch to the given foreground and background colors; -1 leaves a color
+ * as it is. */
+void termColor(int fg, int bg) {
+    char seq[64];
+    int len = 0;
+
+    if (fg >= 0 && fg != termFg) {
+        len += termColorParams(seq + len, sizeof(seq) - len, fg, 0);
+        termFg = fg;
+    }
+    if (bg >= 0 && bg != termBg) {
+        if (len) seq[len++] = ';';
+        len += termColorParams(seq + len, sizeof(seq) - len, bg, 1);
+        termBg = bg;
+    }
+    if (len) printf("\x1b[%.*sm", len, seq);
+}
+
+void termResetColor(void) {
+    if (termFg != -1 || termBg != -1) printf("\x1b[0m");
+    termFg = termBg = -1;
+}
+
+/* Frames are bracketed with synchronized update markers when supported,
+ * so the terminal shows them all at once instead of tearing. */
+void termBeginFrame(void) {
+    if (TERMCAPS.syncOutput) printf("\x1b[?2026h");
+}
+
+void termEndFrame(void) {
+    termResetColor();
+    if (TERMCAPS.syncOutput) printf("\x1b[?2026l");
+    fflush(stdout);
+}
+
+/* ============================ Timers ============================ */
+
+/* Hierarchical timer wheel. Time is counted in ticks of TIMER_TICK_MS; each
+ * level has TIMER_WHEEL_SLOTS slots, and a slot at level L covers
+ * TIMER_WHEEL_SLOTS^L ticks. Timers far in the future live in the upper
+ * levels and are cascaded down as the wheel turns, so arming, cancelling
+ * and expiring a timer are all O(1). A bitmap of occupied slots per level
+ * lets us compute the next tick where something happens without scanning,
+ * so the main loop can sleep exactly until then. */
+
+#define TIMER_TICK_MS 10
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_MAX_TICKS ((1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+struct timer {
+    struct timer *next, *prev; /* NULL when not armed. */
+    uint64_t expires;          /* Absolute tick. */
+    int level, slot;
+    void (*callback)(void *arg);
+    void *arg;
+};
+
+struct timerWheel {
+    uint64_t now;     /* Current tick. */
+    uint64_t startMs; /* Time of tick 0. */
+    uint64_t occupied[TIMER_WHEEL_LEVELS];
+    struct timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; /* List heads. */
+};
+
+struct timerWheel mainTimers;
+
+uint64_t timeNowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timerWheelInit(struct timerWheel *w, uint64_t nowMs) {
+    w->now = 0;
+    w->startMs = nowMs;
+    for (int l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+        w->occupied[l] = 0;
+        for (int s = 0; s < TIMER_WHEEL_SLOTS; s++)
+            w->slots[l][s].next = w->slots[l][s].prev = &w->slots[l][s];
+    }
+}
+
+int timerArmed(struct timer *t) {
+    return t->next != NULL;
+}
+
+/* Link an unarmed timer in the slot matching its expiry. */
+void timerWheelInsert(struct timerWheel *w, struct timer *t) {
+    uint64_t delta = t->expires > w->now ? t->expires - w->now : 0;
+    struct timer *head;
+    int level = 0;
+
+    while (level < TIMER_WHEEL_LEVELS - 1 &&
+           delta >= 1ULL << (TIMER_WHEEL_BITS * (level + 1)))
+        level++;
+    t->level = level;
+    t->slot = (t->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+
+    head = &w->slots[t->level][t->slot];
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+    w->occupied[t->level] |= 1ULL << t->slot;
+}
+
+void timerCancel(struct timerWheel *w, struct timer *t) {
+    struct timer *head;
+
+    if (!timerArmed(t)) return;
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+
+    head = &w->slots[t->level][t->slot];
+    if (head->next == head) w->occupied[t->level] &= ~(1ULL << t->slot);
+}
+
+/* Arm (or re-arm) 't' to call 'callback' after 'ms' milliseconds. */
+void timerArm(struct timerWheel *w, struct timer *t, uint64_t ms,
+              void (*callback)(void *arg), void *arg) {
+    uint64_t ticks = (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+    timerCancel(w, t);
+    if (ticks == 0) ticks = 1;
+    if (ticks > TIMER_MAX_TICKS) ticks = TIMER_MAX_TICKS;
+    t->expires = w->now + ticks;
+    t->callback = callback;
+    t->arg = arg;
+    timerWheelInsert(w, t);
+}
+
+/* Unlink the whole list of a slot into 'list'. */
+void timerWheelTakeSlot(struct timerWheel *w, int level, int slot, struct timer *list) {
+    struct timer *head = &w->slots[level][slot];
+
+    list->next = list->prev = list;
+    if (head->next == head) return;
+    list->next = head->next;
+    list->prev = head->prev;
+    list->next->prev = list;
+    list->prev->next = list;
+    head->next = head->prev = head;
+    w->occupied[level] &= ~(1ULL << slot);
+}
+
+/* Return the first tick after 'now' at which a slot has to be processed,
+ * either to run its timers or to cascade them to a lower level. Returns
+ * UINT64_MAX if no timer is armed. */
+uint64_t timerWheelNextTick(struct timerWheel *w) {
+    uint64_t next = UINT64_MAX;
+
+    for (int l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+        uint64_t occ = w->occupied[l], rot, base, tick;
+        int shift = TIMER_WHEEL_BITS * l, r, dist;
+
+        if (occ == 0) continue;
+        base = w->now >> shift;
+        r = (base + 1) & TIMER_WHEEL_MASK;
+        rot = (occ >> r) | (occ << ((TIMER_WHEEL_SLOTS - r) & TIMER_WHEEL_MASK));
+        dist = __builtin_ctzll(rot) + 1;
+        tick = (base + dist) << shift;
+        if (tick < next) next = tick;
+    }
+    return next;
+}
+
+/* Advance the wheel to the current time, running every expired timer.
+ * Empty stretches of the wheel are skipped in a single step. */
+void timerWheelAdvance(struct timerWheel *w, uint64_t nowMs) {
+    uint64_t target = (nowMs - w->startMs) / TIMER_TICK_MS;
+    struct timer list, *t;
+
+    while (w->now < target) {
+        uint64_t next = timerWheelNextTick(w);
+        if (next > target) {
+            w->now = target;
+            break;
+        }
+        w->now = next;
+
+        /* Cascade upper levels whose index just wrapped to this tick. */
+        for (int l = TIMER_WHEEL_LEVELS - 1; l > 0; l--) {
+            int shift = TIMER_WHEEL_BITS * l;
+            if (w->now & ((1ULL << shift) - 1)) continue;
+            timerWheelTakeSlot(w, l, (w->now >> shift) & TIMER_WHEEL_MASK, &list);
+            while (list.next != &list) {
+                t = list.next;
+                list.next = t->next;
+                t->next->prev = &list;
+                timerWheelInsert(w, t);
+            }
+        }
+
+        timerWheelTakeSlot(w, 0, w->now & TIMER_WHEEL_MASK, &list);
+        while (list.next != &list) {
+            t = list.next;
+            list.next = t->next;
+            t->next->prev = &list;
+            t->next = t->prev = NULL;
+            t->callback(t->arg);
+        }
+    }
+}
+
+/* Milliseconds until the wheel needs to be advanced again, suitable as a
+ * poll() timeout. Returns -1 if no timer is armed. */
+int timerWheelTimeout(struct timerWheel *w, uint64_t nowMs) {
+    uint64_t next = timerWheelNextTick(w), deadline;
+
+    if (next == UINT64_MAX) return -1;
+    deadline = w->startMs + next * TIMER_TICK_MS;
+    if (deadline <= nowMs) return 0;
+    if (deadline - nowMs > INT32_MAX) return INT32_MAX;
+    return deadline - nowMs;
+}
+
 /* ========================= Canvas  ======================== */
 
+struct rect {
+    int y0, x0, y1, x1; /* Inclusive. */
+};
+
+#define CANVAS_DIRTY_RECTS 8
+
 struct canvas {
     int starty, startx;
     int sizey, sizex;
     int *colorBuf;
+    unsigned char *overlay; /* Shape preview, drawn on top of colorBuf. */
+    struct rect dirty[CANVAS_DIRTY_RECTS];
+    int ndirty;
+    int borderDirty;
+    int cursory, cursorx; /* Where the brush cursor was last drawn. */
+    int showCursor;
+    struct rect changed; /* Pixels modified since the last timelapse frame. */
+    int hasChanged;
 };
 
-#define CANVAS_INIT {1, 1, 3, 3, NULL}
+#define CANVAS_INIT {1, 1, 3, 3, NULL, NULL, {{0, 0, 0, 0}}, 0, 1, 0, 0, 1, {0, 0, 0, 0}, 0}
 
 struct canvas mainCanvas = CANVAS_INIT;
 
+#define CANVAS_HEIGHT 60 /* Drawable pixels, without the border. */
+#define CANVAS_WIDTH 80
+
 int brushTemplates[5][9][9] = {
     {
         {0, 0, 0, 0, 0, 0, 0, 0, 0},
@@ -459,21 +902,102 @@ int brushTemplates[5][9][9] = {
 
 };
 
+enum TOOL {
+    TOOL_BRUSH = 0,
+    TOOL_FILL,
+    TOOL_LINE,
+    TOOL_RECT,
+    TOOL_ELLIPSE,
+    TOOL_COUNT
+};
+
 int selectedColor = 0;
 int brushSize = 1;
 int minBrushSize = 1, maxBrushSize = 5;
-int fillMode = 0;
+int selectedTool = TOOL_BRUSH;
+
+int rectArea(struct rect *r) {
+    return (r->y1 - r->y0 + 1) * (r->x1 - r->x0 + 1);
+}
+
+/* Remember that the canvas area y0,x0 - y1,x1 has to be drawn again. The
+ * area is merged with the pending rectangle that grows the least, unless
+ * that would waste cells and there is still room for a new one. */
+void canvasMarkDirty(struct canvas *c, int y0, int x0, int y1, int x1) {
+    struct rect r, u;
+    int best = -1, bestCost = 0;
+
+    r.y0 = y0 < 0 ? 0 : y0;
+    r.x0 = x0 < 0 ? 0 : x0;
+    r.y1 = y1 > c->sizey - 3 ? c->sizey - 3 : y1;
+    r.x1 = x1 > c->sizex - 3 ? c->sizex - 3 : x1;
+    if (r.y0 > r.y1 || r.x0 > r.x1) return;
+
+    for (int i = 0; i < c->ndirty; i++) {
+        struct rect *d = &c->dirty[i];
+        u.y0 = r.y0 < d->y0 ? r.y0 : d->y0;
+        u.x0 = r.x0 < d->x0 ? r.x0 : d->x0;
+        u.y1 = r.y1 > d->y1 ? r.y1 : d->y1;
+        u.x1 = r.x1 > d->x1 ? r.x1 : d->x1;
+        int cost = rectArea(&u) - rectArea(d) - rectArea(&r);
+        if (best == -1 || cost < bestCost) {
+            best = i;
+            bestCost = cost;
+        }
+    }
+    if (best == -1 || (bestCost > 0 && c->ndirty < CANVAS_DIRTY_RECTS)) {
+        c->dirty[c->ndirty++] = r;
+        return;
+    }
+    struct rect *d = &c->dirty[best];
+    if (r.y0 < d->y0) d->y0 = r.y0;
+    if (r.x0 < d->x0) d->x0 = r.x0;
+    if (r.y1 > d->y1) d->y1 = r.y1;
+    if (r.x1 > d->x1) d->x1 = r.x1;
+}
+
+void canvasMarkAll(struct canvas *c) {
+    c->ndirty = 0;
+    c->borderDirty = 1;
+    canvasMarkDirty(c, 0, 0, c->sizey - 3, c->sizex - 3);
+}
+
+/* Like canvasMarkDirty(), for areas whose pixels actually changed. These
+ * are also collected into a single rectangle for the timelapse. */
+void canvasMarkChanged(struct canvas *c, int y0, int x0, int y1, int x1) {
+    struct rect *r = &c->changed;
+
+    canvasMarkDirty(c, y0, x0, y1, x1);
+    if (!c->hasChanged) {
+        r->y0 = y0;
+        r->x0 = x0;
+        r->y1 = y1;
+        r->x1 = x1;
+        c->hasChanged = 1;
+        return;
+    }
+    if (y0 < r->y0) r->y0 = y0;
+    if (x0 < r->x0) r->x0 = x0;
+    if (y1 > r->y1) r->y1 = y1;
+    if (x1 > r->x1) r->x1 = x1;
+}
 
 void initializeCanvas(struct canvas *c) {
-    c->colorBuf = realloc(c->colorBuf, (c->sizey - 2) * (c->sizex - 2) * sizeof(int));
-    if (c->colorBuf == NULL) exit(0);
-    for (int i = 0; i < (c->sizey - 2) * (c->sizex - 2); i++)
+    size_t n = (size_t)(c->sizey - 2) * (c->sizex - 2);
+    c->colorBuf = realloc(c->colorBuf, n * sizeof(int));
+    c->overlay = realloc(c->overlay, n);
+    if (c->colorBuf == NULL || c->overlay == NULL) exit(0);
+    for (size_t i = 0; i < n; i++)
         c->colorBuf[i] = 15;
+    memset(c->overlay, 0, n);
+    canvasMarkAll(c);
+    canvasMarkChanged(c, 0, 0, c->sizey - 3, c->sizex - 3);
 }
 
 int setPixel(struct canvas *c, int y, int x, int color) {
     if (y < 0 || y > c->sizey - 3 || x < 0 || x > c->sizex - 3) return -1;
     c->colorBuf[y * (c->sizex - 2) + x] = color;
+    canvasMarkChanged(c, y, x, y, x);
     return 0;
 }
 
@@ -498,44 +1022,81 @@ int isBrushPixel(int y, int x) {
     return brushTemplates[brushSize - 1][by][bx];
 }
 
-int canvasRefreshScreen(struct canvas *c) {
-    if (c->startx < 1 || c->starty < 1) {
-        return -1;
-    }
-
+void canvasDrawBorder(struct canvas *c) {
+    termResetColor();
     printf("\x1b[%d;%dH", c->starty, c->startx);
     printf("╔");
     for (int j = c->startx + 1; j < NCOLS && j < c->startx + c->sizex - 1; j++)
         printf("═");
     printf("╗");
-    int cy, cx, color = -1;
     for (int i = c->starty + 1; i < NROWS && i < c->starty + c->sizey - 1; i++) {
-        printf("\x1b[%d;%dH", i, c->startx);
-        printf("║");
-        for (int j = c->startx + 1; j < NCOLS && j < c->startx + c->sizex - 1; j++) {
-            translateCanvasPosition(&mainCanvas, i, j, &cy, &cx);
-            if (fillMode && MOUSEY == i && MOUSEX == j)
-                printf("\x1b[48;5;%dm\x1b[38;5;%dmU\x1b[0m", selectedColor, (selectedColor < 7 ? 15 : 0));
-            else if (!fillMode && isBrushPixel(cy, cx))
-                printf("\x1b[48;5;%dm\x1b[38;5;%dm▒\x1b[0m", selectedColor, (selectedColor < 15 ? 15 : 7));
-            else {
-                color = getPixel(&mainCanvas, cy, cx);
-                if (color < 0 || color > 15)
-                    printf("#");
-                else
-                    printf("\x1b[48;5;%dm ", color);
-            }
-        }
-        printf("\x1b[0m");
-        printf("║");
+        printf("\x1b[%d;%dH║", i, c->startx);
+        printf("\x1b[%d;%dH║", i, c->startx + c->sizex - 1);
     }
     printf("\x1b[%d;%dH", c->starty + c->sizey - 1, c->startx);
     printf("╚");
     for (int j = c->startx + 1; j < NCOLS && j < c->startx + c->sizex - 1; j++)
         printf("═");
     printf("╝");
+}
 
-    fflush(stdout);
+/* Draw the canvas cell cy,cx, found at screen position i,j. */
+void canvasDrawCell(struct canvas *c, int cy, int cx, int i, int j) {
+    int color;
+
+    if (c->showCursor && selectedTool != TOOL_BRUSH && MOUSEY == i && MOUSEX == j) {
+        termColor(selectedColor < 7 ? 15 : 0, selectedColor);
+        printf("%s", selectedTool == TOOL_FILL ? "U" : "+");
+    } else if ((c->showCursor && selectedTool == TOOL_BRUSH && isBrushPixel(cy, cx)) ||
+               c->overlay[cy * (c->sizex - 2) + cx]) {
+        termColor(selectedColor < 15 ? 15 : 7, selectedColor);
+        printf("▒");
+    } else {
+        color = getPixel(c, cy, cx);
+        if (color < 0 || color > 15) {
+            termResetColor();
+            printf("#");
+        } else {
+            termColor(-1, color);
+            printf(" ");
+        }
+    }
+}
+
+/* Draw the parts of the canvas marked as dirty since the last refresh. */
+int canvasRefreshScreen(struct canvas *c) {
+    int cy, cx;
+
+    if (c->startx < 1 || c->starty < 1) {
+        return -1;
+    }
+
+    /* The brush cursor follows the mouse: redraw where it was and where
+     * it is now. */
+    if (c->showCursor) {
+        canvasMarkDirty(c, c->cursory - 4, c->cursorx - 4, c->cursory + 4, c->cursorx + 4);
+        translateCanvasPosition(c, MOUSEY, MOUSEX, &cy, &cx);
+        canvasMarkDirty(c, cy - 4, cx - 4, cy + 4, cx + 4);
+        c->cursory = cy;
+        c->cursorx = cx;
+    }
+
+    if (c->borderDirty) canvasDrawBorder(c);
+    for (int k = 0; k < c->ndirty; k++) {
+        struct rect *d = &c->dirty[k];
+        for (cy = d->y0; cy <= d->y1; cy++) {
+            int i = c->starty + 1 + cy;
+            if (i >= NROWS) break;
+            printf("\x1b[%d;%dH", i, c->startx + 1 + d->x0);
+            for (cx = d->x0; cx <= d->x1; cx++) {
+                int j = c->startx + 1 + cx;
+                if (j >= NCOLS) break;
+                canvasDrawCell(c, cy, cx, i, j);
+            }
+        }
+    }
+    c->ndirty = 0;
+    c->borderDirty = 0;
 
     return 0;
 }
@@ -551,13 +1112,762 @@ int fillCanvas(struct canvas *c, int y, int x, int old_color, int new_color) {
            fillCanvas(c, y, x - 1, old_color, new_color);
 }
 
+/* ========================= Shapes  ======================== */
+
+/* Shapes are rasterized as horizontal spans, x0..x1 inclusive on row y,
+ * using integer arithmetic only. The same rasterizer feeds both the live
+ * preview (drawn in the canvas overlay) and the final commit. */
+
+typedef void spanFunc(void *ctx, int y, int x0, int x1);
+
+/* Bresenham line, emitting one span per row. */
+void rasterLine(int y0, int x0, int y1, int x1, spanFunc *emit, void *ctx) {
+    int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+    int dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+    int err = dx + dy, e2, runx = x0;
+
+    while (1) {
+        if (y0 == y1 && x0 == x1) {
+            emit(ctx, y0, runx < x0 ? runx : x0, runx < x0 ? x0 : runx);
+            break;
+        }
+        int py = y0, px = x0;
+        e2 = 2 * err;
+        if (e2 >= dy) {
+            err += dy;
+            x0 += sx;
+        }
+        if (e2 <= dx) {
+            err += dx;
+            y0 += sy;
+        }
+        if (y0 != py) {
+            emit(ctx, py, runx < px ? runx : px, runx < px ? px : runx);
+            runx = x0;
+        }
+    }
+}
+
+/* Outline of the rectangle with corners y0,x0 and y1,x1. */
+void rasterRect(int y0, int x0, int y1, int x1, spanFunc *emit, void *ctx) {
+    int t;
+    if (y0 > y1) t = y0, y0 = y1, y1 = t;
+    if (x0 > x1) t = x0, x0 = x1, x1 = t;
+
+    emit(ctx, y0, x0, x1);
+    for (int y = y0 + 1; y < y1; y++) {
+        emit(ctx, y, x0, x0);
+        if (x1 != x0) emit(ctx, y, x1, x1);
+    }
+    if (y1 != y0) emit(ctx, y1, x0, x1);
+}
+
+/* Emit the left run a0..a1 and right run b0..b1 of an ellipse row, as a
+ * single span when they touch. */
+void rasterEllipseRow(int y, int a0, int a1, int b0, int b1, spanFunc *emit, void *ctx) {
+    if (a1 + 1 >= b0) {
+        emit(ctx, y, a0 < b0 ? a0 : b0, a1 > b1 ? a1 : b1);
+    } else {
+        emit(ctx, y, a0, a1);
+        emit(ctx, y, b0, b1);
+    }
+}
+
+/* Outline of the ellipse inscribed in the rectangle with corners y0,x0 and
+ * y1,x1, using the midpoint algorithm for arbitrary bounding boxes. Each
+ * step moves x0/x1 inward or y0/y1 outward: consecutive points on the same
+ * row are collected into runs, which are emitted when the row changes. */
+void rasterEllipse(int y0, int x0, int y1, int x1, spanFunc *emit, void *ctx) {
+    long a = abs(x1 - x0), b = abs(y1 - y0), b1 = b & 1;
+    long dx = 4 * (1 - a) * b * b, dy = 4 * (b1 + 1) * a * a;
+    long err = dx + dy + b1 * a * a, e2;
+    int runx0, runx1;
+
+    if (x0 > x1) {
+        x0 = x1;
+        x1 += a;
+    }
+    if (y0 > y1) y0 = y1;
+    y0 += (b + 1) / 2;
+    y1 = y0 - b1;
+    a *= 8 * a;
+    b1 = 8 * b * b;
+
+    runx0 = x0;
+    runx1 = x1;
+    do {
+        int py0 = y0, py1 = y1, px0 = x0, px1 = x1;
+        e2 = 2 * err;
+        if (e2 <= dy) {
+            y0++;
+            y1--;
+            err += dy += a;
+        }
+        if (e2 >= dx || 2 * err > dy) {
+            x0++;
+            x1--;
+            err += dx += b1;
+        }
+        if (y0 != py0 || x0 > x1) {
+            rasterEllipseRow(py0, runx0, px0, px1, runx1, emit, ctx);
+            if (py1 != py0) rasterEllipseRow(py1, runx0, px0, px1, runx1, emit, ctx);
+            runx0 = x0;
+            runx1 = x1;
+        }
+    } while (x0 <= x1);
+
+    /* Flat ellipses stop too early: finish the tips. */
+    while (y0 - y1 <= b) {
+        rasterEllipseRow(y0++, x0 - 1, x0 - 1, x1 + 1, x1 + 1, emit, ctx);
+        rasterEllipseRow(y1--, x0 - 1, x0 - 1, x1 + 1, x1 + 1, emit, ctx);
+    }
+}
+
+struct shape {
+    int tool; /* TOOL_LINE, TOOL_RECT or TOOL_ELLIPSE. */
+    int y0, x0, y1, x1;
+};
+
+void rasterShape(struct shape *s, spanFunc *emit, void *ctx) {
+    switch (s->tool) {
+    case TOOL_LINE:
+        rasterLine(s->y0, s->x0, s->y1, s->x1, emit, ctx);
+        break;
+    case TOOL_RECT:
+        rasterRect(s->y0, s->x0, s->y1, s->x1, emit, ctx);
+        break;
+    case TOOL_ELLIPSE:
+        rasterEllipse(s->y0, s->x0, s->y1, s->x1, emit, ctx);
+        break;
+    }
+}
+
+/* Clip a span to the canvas. Returns 0 if nothing is left. */
+int canvasClipSpan(struct canvas *c, int y, int *x0, int *x1) {
+    if (y < 0 || y > c->sizey - 3) return 0;
+    if (*x0 < 0) *x0 = 0;
+    if (*x1 > c->sizex - 3) *x1 = c->sizex - 3;
+    return *x0 <= *x1;
+}
+
+void canvasSetOverlaySpan(void *ctx, int y, int x0, int x1) {
+    struct canvas *c = ctx;
+    if (canvasClipSpan(c, y, &x0, &x1))
+        memset(c->overlay + y * (c->sizex - 2) + x0, 1, x1 - x0 + 1);
+}
+
+void canvasClearOverlaySpan(void *ctx, int y, int x0, int x1) {
+    struct canvas *c = ctx;
+    if (canvasClipSpan(c, y, &x0, &x1))
+        memset(c->overlay + y * (c->sizex - 2) + x0, 0, x1 - x0 + 1);
+}
+
+void canvasFillSpan(void *ctx, int y, int x0, int x1) {
+    struct canvas *c = ctx;
+    if (!canvasClipSpan(c, y, &x0, &x1)) return;
+    for (int x = x0; x <= x1; x++)
+        c->colorBuf[y * (c->sizex - 2) + x] = selectedColor;
+    canvasMarkChanged(c, y, x0, y, x1);
+}
+
+/* The shape being dragged, shown as a rubber band in the canvas overlay. */
+struct shape shapePreview;
+int shapeDragging = 0;
+
+void shapeMarkDirty(struct canvas *c, struct shape *s) {
+    canvasMarkDirty(c, s->y0 < s->y1 ? s->y0 : s->y1, s->x0 < s->x1 ? s->x0 : s->x1,
+                    s->y0 < s->y1 ? s->y1 : s->y0, s->x0 < s->x1 ? s->x1 : s->x0);
+}
+
+void shapeBegin(struct canvas *c, int tool, int y, int x) {
+    shapePreview.tool = tool;
+    shapePreview.y0 = shapePreview.y1 = y;
+    shapePreview.x0 = shapePreview.x1 = x;
+    shapeDragging = 1;
+    rasterShape(&shapePreview, canvasSetOverlaySpan, c);
+    shapeMarkDirty(c, &shapePreview);
+}
+
+/* Move the free end of the preview: only the old and the new bounding
+ * boxes are redrawn. */
+void shapeUpdate(struct canvas *c, int y, int x) {
+    if (y == shapePreview.y1 && x == shapePreview.x1) return;
+    rasterShape(&shapePreview, canvasClearOverlaySpan, c);
+    shapeMarkDirty(c, &shapePreview);
+    shapePreview.y1 = y;
+    shapePreview.x1 = x;
+    rasterShape(&shapePreview, canvasSetOverlaySpan, c);
+    shapeMarkDirty(c, &shapePreview);
+}
+
+void shapeCommit(struct canvas *c) {
+    rasterShape(&shapePreview, canvasClearOverlaySpan, c);
+    shapeMarkDirty(c, &shapePreview);
+    rasterShape(&shapePreview, canvasFillSpan, c);
+    shapeDragging = 0;
+}
+
+/* ========================= Timelapse  ======================== */
+
+/* A timelapse file records how the canvas was built, so it can be played
+ * back or exported. After a small header (magic, canvas height and width)
+ * it is a stream of frames, one per event that changed the canvas:
+ *
+ *   type (1 byte)    'K' for a keyframe, 'D' for a delta
+ *   time (4 bytes)   milliseconds since the recording started
+ *   y, x, h, w       the rectangle the frame covers, 2 bytes each
+ *   len (4 bytes)    length of the payload
+ *   payload          the rectangle pixels in row order, run length encoded
+ *                    as (count, color) byte pairs
+ *
+ * A delta covers just the area changed since the previous frame, and every
+ * TIMELAPSE_KEYFRAME_INTERVAL frames a keyframe covers the whole canvas.
+ * All integers are little endian. Frames are written and read one at a
+ * time, so memory use depends on the canvas size only, not on the length
+ * of the session. */
+
+#define TIMELAPSE_MAGIC "TPLAPSE1"
+#define TIMELAPSE_KEYFRAME_INTERVAL 256
+#define TIMELAPSE_MAX_GAP_MS 500 /* Pauses are shortened to this on replay. */
+#define TIMELAPSE_MAX_SIZE 1024  /* Largest canvas height or width we accept. */
+
+struct timelapseFrame {
+    int type;
+    uint32_t ms;
+    int y, x, h, w;
+    uint32_t len;
+    unsigned char *data;
+};
+
+struct timelapse {
+    FILE *fp;
+    int sizey, sizex; /* Canvas pixels, without the border. */
+    uint64_t startMs;
+    uint32_t frames;
+    unsigned char *buf; /* Payload of one frame, at most 2 bytes per pixel. */
+};
+
+struct timelapse mainTimelapse;
+
+void timelapsePut16(FILE *fp, unsigned v) {
+    fputc(v & 0xff, fp);
+    fputc((v >> 8) & 0xff, fp);
+}
+
+void timelapsePut32(FILE *fp, uint32_t v) {
+    timelapsePut16(fp, v & 0xffff);
+    timelapsePut16(fp, v >> 16);
+}
+
+int timelapseGet16(FILE *fp, unsigned *v) {
+    int lo = fgetc(fp), hi = fgetc(fp);
+    if (lo == EOF || hi == EOF) return -1;
+    *v = lo | (hi << 8);
+    return 0;
+}
+
+int timelapseGet32(FILE *fp, uint32_t *v) {
+    unsigned lo, hi;
+    if (timelapseGet16(fp, &lo) == -1 || timelapseGet16(fp, &hi) == -1) return -1;
+    *v = lo | ((uint32_t)hi << 16);
+    return 0;
+}
+
+/* Write the canvas rectangle y0,x0 - y1,x1 as a frame of the given type. */
+int timelapseWriteFrame(struct timelapse *t, struct canvas *c, int type,
+                        int y0, int x0, int y1, int x1) {
+    uint32_t len = 0;
+    int run = 0, runColor = -1;
+
+    for (int y = y0; y <= y1; y++) {
+        for (int x = x0; x <= x1; x++) {
+            int color = getPixel(c, y, x);
+            if (color == runColor && run < 255) {
+                run++;
+                continue;
+            }
+            if (run) {
+                t->buf[len++] = run;
+                t->buf[len++] = runColor;
+            }
+            run = 1;
+            runColor = color;
+        }
+    }
+    t->buf[len++] = run;
+    t->buf[len++] = runColor;
+
+    fputc(type, t->fp);
+    timelapsePut32(t->fp, timeNowMs() - t->startMs);
+    timelapsePut16(t->fp, y0);
+    timelapsePut16(t->fp, x0);
+    timelapsePut16(t->fp, y1 - y0 + 1);
+    timelapsePut16(t->fp, x1 - x0 + 1);
+    timelapsePut32(t->fp, len);
+    if (fwrite(t->buf, 1, len, t->fp) != len) return -1;
+    return 0;
+}
+
+/* Start recording a canvas of sizey x sizex pixels to 'path'. The first
+ * frame recorded is a keyframe. Returns 0 on success, -1 on error. */
+int timelapseOpen(struct timelapse *t, const char *path, int sizey, int sizex) {
+    t->sizey = sizey;
+    t->sizex = sizex;
+    t->startMs = timeNowMs();
+    t->frames = 0;
+    t->buf = malloc(2 * (size_t)sizey * sizex);
+    if (t->buf == NULL) return -1;
+    if ((t->fp = fopen(path, "wb")) == NULL) {
+        free(t->buf);
+        t->buf = NULL;
+        return -1;
+    }
+
+    fwrite(TIMELAPSE_MAGIC, 1, 8, t->fp);
+    timelapsePut16(t->fp, sizey);
+    timelapsePut16(t->fp, sizex);
+    return 0;
+}
+
+/* Append a frame with whatever changed on the canvas since the last one. */
+void timelapseRecord(struct timelapse *t, struct canvas *c) {
+    struct rect *r = &c->changed;
+
+    if (t->fp == NULL || !c->hasChanged) return;
+    c->hasChanged = 0;
+    if (t->frames++ % TIMELAPSE_KEYFRAME_INTERVAL == 0)
+        timelapseWriteFrame(t, c, 'K', 0, 0, t->sizey - 1, t->sizex - 1);
+    else
+        timelapseWriteFrame(t, c, 'D', r->y0 < 0 ? 0 : r->y0, r->x0 < 0 ? 0 : r->x0,
+                            r->y1 >= t->sizey ? t->sizey - 1 : r->y1,
+                            r->x1 >= t->sizex ? t->sizex - 1 : r->x1);
+    /* Don't lose the tail of the session if we get killed. */
+    fflush(t->fp);
+}
+
+void timelapseClose(struct timelapse *t) {
+    if (t->fp) fclose(t->fp);
+    free(t->buf);
+    t->fp = NULL;
+    t->buf = NULL;
+}
+
+/* Open a timelapse for reading. Returns 0 on success, -1 on error. */
+int timelapseOpenRead(struct timelapse *t, const char *path) {
+    char magic[8];
+    unsigned sizey, sizex;
+
+    if ((t->fp = fopen(path, "rb")) == NULL) return -1;
+    if (fread(magic, 1, 8, t->fp) != 8 || memcmp(magic, TIMELAPSE_MAGIC, 8) != 0 ||
+        timelapseGet16(t->fp, &sizey) == -1 || timelapseGet16(t->fp, &sizex) == -1 ||
+        sizey == 0 || sizex == 0 || sizey > TIMELAPSE_MAX_SIZE || sizex > TIMELAPSE_MAX_SIZE)
+        goto failed;
+    t->sizey = sizey;
+    t->sizex = sizex;
+    t->frames = 0;
+    t->buf = NULL;
+    return 0;
+
+failed:
+    fclose(t->fp);
+    t->fp = NULL;
+    errno = EINVAL;
+    return -1;
+}
+
+/* Read the next frame into 'f', whose data buffer must hold 2 bytes per
+ * canvas pixel. Returns 1 on success, 0 at the end of the file and -1 if
+ * the file is corrupted. A frame cut short by the end of the file, as left
+ * by a recording that was killed, counts as the end. */
+int timelapseReadFrame(struct timelapse *t, struct timelapseFrame *f) {
+    unsigned y, x, h, w;
+
+    if ((f->type = fgetc(t->fp)) == EOF) return 0;
+    if (timelapseGet32(t->fp, &f->ms) == -1 ||
+        timelapseGet16(t->fp, &y) == -1 || timelapseGet16(t->fp, &x) == -1 ||
+        timelapseGet16(t->fp, &h) == -1 || timelapseGet16(t->fp, &w) == -1 ||
+        timelapseGet32(t->fp, &f->len) == -1)
+        return feof(t->fp) ? 0 : -1;
+    if ((f->type != 'K' && f->type != 'D') || h == 0 || w == 0 ||
+        y + h > (unsigned)t->sizey || x + w > (unsigned)t->sizex ||
+        f->len > 2 * (size_t)t->sizey * t->sizex || f->len % 2)
+        return -1;
+    f->y = y;
+    f->x = x;
+    f->h = h;
+    f->w = w;
+    if (fread(f->data, 1, f->len, t->fp) != f->len) return feof(t->fp) ? 0 : -1;
+    t->frames++;
+    return 1;
+}
+
+/* Expand the run length encoded payload of a frame into 'pixels', one
+ * byte per pixel of its rectangle in row order. */
+void timelapseUnpackFrame(struct timelapseFrame *f, unsigned char *pixels) {
+    size_t n = 0, total = (size_t)f->h * f->w;
+
+    for (uint32_t i = 0; i < f->len && n < total; i += 2) {
+        for (int k = 0; k < f->data[i] && n < total; k++)
+            pixels[n++] = f->data[i + 1];
+    }
+    while (n < total)
+        pixels[n++] = 15;
+}
+
+/* Frame delay on replay, with pauses shortened and 'speed' applied. */
+uint64_t timelapseDelayMs(uint32_t from, uint32_t to, double speed) {
+    uint32_t gap = to > from ? to - from : 0;
+    if (gap > TIMELAPSE_MAX_GAP_MS) gap = TIMELAPSE_MAX_GAP_MS;
+    return gap / speed;
+}
+
+/* ------------------------- GIF export ------------------------- */
+
+/* Streaming LZW encoder for GIF image data, with 4 bit pixels. Codes are
+ * looked up in a fixed size open addressing table, and the table is reset
+ * with a clear code once all 4096 codes are used. */
+
+#define GIF_MIN_CODE_SIZE 4
+#define GIF_CLEAR_CODE (1 << GIF_MIN_CODE_SIZE)
+#define GIF_EOI_CODE (GIF_CLEAR_CODE + 1)
+#define GIF_MAX_CODE 4095
+#define GIF_HASH_SIZE 5003
+
+struct gifEncoder {
+    FILE *fp;
+    unsigned char block[255];
+    int blockLen;
+    uint32_t bits;
+    int nbits;
+    int codeSize;
+    int nextCode;
+    int prefix;
+    int32_t keys[GIF_HASH_SIZE];
+    int16_t codes[GIF_HASH_SIZE];
+};
+
+void gifPutCode(struct gifEncoder *g, int code) {
+    g->bits |= (uint32_t)code << g->nbits;
+    g->nbits += g->codeSize;
+    while (g->nbits >= 8) {
+        g->block[g->blockLen++] = g->bits & 0xff;
+        g->bits >>= 8;
+        g->nbits -= 8;
+        if (g->blockLen == 255) {
+            fputc(255, g->fp);
+            fwrite(g->block, 1, 255, g->fp);
+            g->blockLen = 0;
+        }
+    }
+}
+
+void gifResetTable(struct gifEncoder *g) {
+    memset(g->keys, 0xff, sizeof(g->keys));
+    g->codeSize = GIF_MIN_CODE_SIZE + 1;
+    g->nextCode = GIF_EOI_CODE + 1;
+}
+
+void gifBeginImage(struct gifEncoder *g) {
+    fputc(GIF_MIN_CODE_SIZE, g->fp);
+    g->blockLen = 0;
+    g->bits = 0;
+    g->nbits = 0;
+    g->prefix = -1;
+    gifResetTable(g);
+    gifPutCode(g, GIF_CLEAR_CODE);
+}
+
+void gifPutPixel(struct gifEncoder *g, int pixel) {
+    int32_t key;
+    int h;
+
+    if (g->prefix == -1) {
+        g->prefix = pixel;
+        return;
+    }
+    key = (g->prefix << 4) | pixel;
+    h = key % GIF_HASH_SIZE;
+    while (g->keys[h] != -1) {
+        if (g->keys[h] == key) {
+            g->prefix = g->codes[h];
+            return;
+        }
+        if (++h == GIF_HASH_SIZE) h = 0;
+    }
+
+    gifPutCode(g, g->prefix);
+    g->prefix = pixel;
+    g->keys[h] = key;
+    g->codes[h] = g->nextCode;
+    if (g->nextCode >= (1 << g->codeSize)) g->codeSize++;
+    if (++g->nextCode > GIF_MAX_CODE) {
+        gifPutCode(g, GIF_CLEAR_CODE);
+        gifResetTable(g);
+    }
+}
+
+void gifEndImage(struct gifEncoder *g) {
+    if (g->prefix != -1) gifPutCode(g, g->prefix);
+    /* Reading that last code makes the decoder add one more table entry,
+     * which may widen its codes before it reads the EOI. */
+    if (g->nextCode > GIF_EOI_CODE + 1 && g->nextCode >= (1 << g->codeSize) && g->codeSize < 12)
+        g->codeSize++;
+    gifPutCode(g, GIF_EOI_CODE);
+    if (g->nbits > 0) g->block[g->blockLen++] = g->bits & 0xff; /* Partial last byte. */
+    if (g->blockLen) {
+        fputc(g->blockLen, g->fp);
+        fwrite(g->block, 1, g->blockLen, g->fp);
+    }
+    fputc(0, g->fp);
+}
+
+/* Write one timelapse frame as a GIF image covering just its rectangle,
+ * every pixel scaled to a 'scale' x 'scale' square. */
+void gifWriteFrame(struct gifEncoder *g, struct timelapseFrame *f, unsigned char *pixels,
+                   int scale, int delayCs) {
+    FILE *fp = g->fp;
+
+    timelapseUnpackFrame(f, pixels);
+
+    /* Graphic control extension: keep the previous frame, set the delay. */
+    fputc(0x21, fp);
+    fputc(0xf9, fp);
+    fputc(4, fp);
+    fputc(0x04, fp);
+    timelapsePut16(fp, delayCs);
+    fputc(0, fp);
+    fputc(0, fp);
+
+    /* Image descriptor, using the global color table. */
+    fputc(0x2c, fp);
+    timelapsePut16(fp, f->x * scale);
+    timelapsePut16(fp, f->y * scale);
+    timelapsePut16(fp, f->w * scale);
+    timelapsePut16(fp, f->h * scale);
+    fputc(0, fp);
+
+    gifBeginImage(g);
+    for (int y = 0; y < f->h * scale; y++) {
+        for (int x = 0; x < f->w * scale; x++)
+            gifPutPixel(g, pixels[(y / scale) * f->w + x / scale] & 0x0f);
+    }
+    gifEndImage(g);
+}
+
+/* Convert the timelapse at 'in' to an animated GIF at 'out'. Only the
+ * current and the next frame are kept in memory: the next one is needed
+ * to know how long the current one stays on screen.
+ * Returns 0 on success, -1 on error, in which case 'out' is removed. */
+int timelapseExportGif(const char *in, const char *out, double speed, int scale) {
+    struct timelapse t;
+    struct timelapseFrame frames[2], *cur = &frames[0], *next = &frames[1], *tmp;
+    struct gifEncoder *g = NULL;
+    unsigned char *pixels = NULL;
+    size_t cells;
+    int ret = -1, more;
+
+    if (timelapseOpenRead(&t, in) == -1) return -1;
+    /* GIF sizes are 16 bit. */
+    if ((long)t.sizey * scale > 65535 || (long)t.sizex * scale > 65535) {
+        fclose(t.fp);
+        errno = EINVAL;
+        return -1;
+    }
+    cells = (size_t)t.sizey * t.sizex;
+    frames[0].data = malloc(2 * cells);
+    frames[1].data = malloc(2 * cells);
+    pixels = malloc(cells);
+    g = calloc(1, sizeof(*g));
+    if (!frames[0].data || !frames[1].data || !pixels || !g) goto done;
+    if ((g->fp = fopen(out, "wb")) == NULL) goto done;
+
+    /* Header, logical screen and the global color table. */
+    fwrite("GIF89a", 1, 6, g->fp);
+    timelapsePut16(g->fp, t.sizex * scale);
+    timelapsePut16(g->fp, t.sizey * scale);
+    fputc(0xf3, g->fp); /* Global table of 16 colors, 8 bits per channel. */
+    fputc(15, g->fp);
+    fputc(0, g->fp);
+    fwrite(xtermPalette, 1, sizeof(xtermPalette), g->fp);
+
+    /* Loop forever. */
+    fputc(0x21, g->fp);
+    fputc(0xff, g->fp);
+    fputc(11, g->fp);
+    fwrite("NETSCAPE2.0", 1, 11, g->fp);
+    fputc(3, g->fp);
+    fputc(1, g->fp);
+    timelapsePut16(g->fp, 0);
+    fputc(0, g->fp);
+
+    if (timelapseReadFrame(&t, cur) != 1) goto done;
+    do {
+        int delayCs = 300; /* Hold the final picture for a while. */
+        if ((more = timelapseReadFrame(&t, next)) == -1) goto done;
+        if (more) {
+            delayCs = timelapseDelayMs(cur->ms, next->ms, speed) / 10;
+            if (delayCs < 2) delayCs = 2;
+        }
+        gifWriteFrame(g, cur, pixels, scale, delayCs);
+        tmp = cur;
+        cur = next;
+        next = tmp;
+    } while (more);
+
+    fputc(0x3b, g->fp);
+    ret = 0;
+
+done:
+    if (g && g->fp) {
+        if (fclose(g->fp) != 0) ret = -1;
+        if (ret == -1) remove(out);
+    }
+    free(g);
+    free(pixels);
+    free(frames[0].data);
+    free(frames[1].data);
+    fclose(t.fp);
+    return ret;
+}
+
 /* ========================= Toolbar  ======================== */
 
-int toolbarColors[22] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 7, 7, 7, 7, 7, 7};
-int toolbarSelected[22] = {1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0};
-int toolbarPressed[22] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+/* The toolbar is a retained set of widgets. Each one remembers its state
+ * and is only drawn again when that state changes, and a map from screen
+ * cells to widgets answers "what is under the mouse" in O(1), so neither
+ * drawing a frame nor handling a click depends on the number of buttons. */
+
+#define WIDGET_PRESS_MS 100 /* How long a pressed button stays highlighted. */
+
+struct widget {
+    int y, x, h, w; /* Screen position and size. */
+    int color;      /* Background color. */
+    char icon[8];   /* Drawn in the center. */
+    int hoverable;
+    int selected, hovered, pressed, dirty;
+    void (*onPress)(struct widget *w);
+    int arg;
+};
+
+struct widgetLayer {
+    int y, x, h, w; /* Screen area covered by the widgets. */
+    struct widget *widgets;
+    int count;
+    short *hitMap;    /* Widget index for every cell of the area, or -1. */
+    short *dirtyList; /* Widgets to draw at the next refresh. */
+    int ndirty;
+    int hovered, pressed; /* Widget indexes, or -1. */
+    struct timer releaseTimer;
+};
+
+void widgetMarkDirty(struct widgetLayer *l, int i) {
+    if (i < 0 || l->widgets[i].dirty) return;
+    l->widgets[i].dirty = 1;
+    l->dirtyList[l->ndirty++] = i;
+}
+
+void widgetMarkAll(struct widgetLayer *l) {
+    for (int i = 0; i < l->count; i++)
+        widgetMarkDirty(l, i);
+}
+
+/* Index the widgets of a layer. Returns 0 on success, -1 on error. */
+int widgetLayerInit(struct widgetLayer *l, struct widget *widgets, int count) {
+    struct widget *w;
+
+    l->widgets = widgets;
+    l->count = count;
+    l->y = l->x = INT32_MAX;
+    l->h = l->w = 0;
+    for (int i = 0; i < count; i++) {
+        if (widgets[i].y < l->y) l->y = widgets[i].y;
+        if (widgets[i].x < l->x) l->x = widgets[i].x;
+    }
+    for (int i = 0; i < count; i++) {
+        if (widgets[i].y + widgets[i].h - l->y > l->h) l->h = widgets[i].y + widgets[i].h - l->y;
+        if (widgets[i].x + widgets[i].w - l->x > l->w) l->w = widgets[i].x + widgets[i].w - l->x;
+    }
+
+    l->hitMap = realloc(l->hitMap, l->h * l->w * sizeof(short));
+    l->dirtyList = realloc(l->dirtyList, count * sizeof(short));
+    if (l->hitMap == NULL || l->dirtyList == NULL) return -1;
+    for (int i = 0; i < l->h * l->w; i++)
+        l->hitMap[i] = -1;
+    for (int i = 0; i < count; i++) {
+        w = &widgets[i];
+        for (int y = w->y - l->y; y < w->y - l->y + w->h; y++)
+            for (int x = w->x - l->x; x < w->x - l->x + w->w; x++)
+                l->hitMap[y * l->w + x] = i;
+        w->dirty = 0;
+    }
 
-int TOOLBARSTARTY, TOOLBARSTARTX, TOOLBARENDY, TOOLBARENDX;
+    l->ndirty = 0;
+    l->hovered = l->pressed = -1;
+    widgetMarkAll(l);
+    return 0;
+}
+
+void widgetLayerFree(struct widgetLayer *l) {
+    timerCancel(&mainTimers, &l->releaseTimer);
+    free(l->hitMap);
+    free(l->dirtyList);
+    l->hitMap = l->dirtyList = NULL;
+}
+
+/* Index of the widget at screen position y,x, or -1. */
+int widgetAt(struct widgetLayer *l, int y, int x) {
+    y -= l->y;
+    x -= l->x;
+    if (y < 0 || y >= l->h || x < 0 || x >= l->w) return -1;
+    return l->hitMap[y * l->w + x];
+}
+
+void widgetSetSelected(struct widgetLayer *l, int i, int selected) {
+    if (l->widgets[i].selected == selected) return;
+    l->widgets[i].selected = selected;
+    widgetMarkDirty(l, i);
+}
+
+void widgetRelease(void *arg) {
+    struct widgetLayer *l = arg;
+    if (l->pressed == -1) return;
+    l->widgets[l->pressed].pressed = 0;
+    widgetMarkDirty(l, l->pressed);
+    l->pressed = -1;
+}
+
+/* Track the widget under the mouse. */
+void widgetLayerHover(struct widgetLayer *l, int y, int x) {
+    int i = widgetAt(l, y, x);
+
+    if (i != -1 && !l->widgets[i].hoverable) i = -1;
+    if (i == l->hovered) return;
+    if (l->hovered != -1) {
+        l->widgets[l->hovered].hovered = 0;
+        widgetMarkDirty(l, l->hovered);
+    }
+    if (i != -1) {
+        l->widgets[i].hovered = 1;
+        widgetMarkDirty(l, i);
+    }
+    l->hovered = i;
+}
+
+/* Press the widget at y,x, if any. Returns 1 if a widget was pressed. */
+int widgetLayerPress(struct widgetLayer *l, int y, int x) {
+    int i = widgetAt(l, y, x);
+    struct widget *w;
+
+    if (i == -1 || l->widgets[i].onPress == NULL) return 0;
+    w = &l->widgets[i];
+    if (l->pressed != i) widgetRelease(l);
+    w->pressed = 1;
+    widgetMarkDirty(l, i);
+    l->pressed = i;
+    timerArm(&mainTimers, &l->releaseTimer, WIDGET_PRESS_MS, widgetRelease, l);
+    w->onPress(w);
+    return 1;
+}
 
 char selectedChar[3][3][4] = {
     {"╔", "═", "╗"},
@@ -570,42 +1880,619 @@ char hoveredChar[3][3][4] = {
     {"└", "─", "┘"},
 };
 
-char toolbarIcons[6][4] = {"/", "U", "X", "-", " ", "+"};
-
-void toolbarRefreshScreen() {
+/* Draw a 3x3 button. */
+void widgetDraw(struct widget *w) {
+    termColor(w->color < 7 ? 15 : 0, w->color);
     for (int i = 0; i < 3; i++) {
-        printf("\x1b[%d;%dH", TOOLBARSTARTY + i, TOOLBARSTARTX);
-        for (int j = 0; j < 22; j++) {
-            printf("\x1b[48;5;%dm", toolbarColors[j]);
-            if (toolbarColors[j] < 7)
-                printf("\x1b[38;5;15m");
+        printf("\x1b[%d;%dH", w->y + i, w->x);
+        for (int k = 0; k < 3; k++) {
+            if (i == 1 && k == 1)
+                printf("%s", w->icon);
+            else if (w->pressed)
+                printf("█");
+            else if (w->selected)
+                printf("%s", selectedChar[i][k]);
+            else if (w->hovered)
+                printf("%s", hoveredChar[i][k]);
             else
-                printf("\x1b[38;5;0m");
-            for (int k = 0; k < 3; k++) {
-                if (i == 1 && k == 1) {
-                    if (j < 16)
-                        printf(" ");
-                    else if (j == 20)
-                        printf("%d", brushSize);
-                    else
-                        printf("%s", toolbarIcons[j - 16]);
-                } else if (toolbarPressed[j]) {
-                    printf("█");
-                } else if (toolbarSelected[j]) {
-                    printf("%s", selectedChar[i][k]);
-                } else if (MOUSEY >= TOOLBARSTARTY && MOUSEY <= TOOLBARENDY &&
-                           TOOLBARSTARTX + 3 * j <= MOUSEX &&
-                           TOOLBARSTARTX + 3 * j + 2 >= MOUSEX &&
-                           j != 20)
-                    printf("%s", hoveredChar[i][k]);
-                else
-                    printf(" ");
+                printf(" ");
+        }
+    }
+}
+
+/* Draw the widgets whose state changed since the last refresh. */
+void widgetLayerRefresh(struct widgetLayer *l) {
+    for (int k = 0; k < l->ndirty; k++) {
+        struct widget *w = &l->widgets[l->dirtyList[k]];
+        widgetDraw(w);
+        w->dirty = 0;
+    }
+    l->ndirty = 0;
+}
+
+/* Buttons 0-15 select a color, then come the tools (in enum TOOL order),
+ * clear, and the brush size controls. */
+#define TOOLBAR_BUTTONS 25
+#define TOOLBAR_FIRST_TOOL 16
+#define TOOLBAR_CLEAR 21
+#define TOOLBAR_SMALLER 22
+#define TOOLBAR_SIZE 23
+#define TOOLBAR_BIGGER 24
+
+struct widget toolbarWidgets[TOOLBAR_BUTTONS];
+struct widgetLayer toolbar;
+
+int TOOLBARSTARTY, TOOLBARSTARTX, TOOLBARENDY;
+
+char toolbarIcons[TOOLBAR_BUTTONS - TOOLBAR_FIRST_TOOL][4] = {"/", "U", "╲", "□", "○", "X", "-", " ", "+"};
+
+void setBrushSize(int size) {
+    if (size < minBrushSize) size = minBrushSize;
+    if (size > maxBrushSize) size = maxBrushSize;
+    brushSize = size;
+    snprintf(toolbarWidgets[TOOLBAR_SIZE].icon, sizeof(toolbarWidgets[TOOLBAR_SIZE].icon), "%d", size);
+    widgetMarkDirty(&toolbar, TOOLBAR_SIZE);
+}
+
+void toolbarSelectColor(struct widget *w) {
+    widgetSetSelected(&toolbar, selectedColor, 0);
+    selectedColor = w->arg;
+    widgetSetSelected(&toolbar, selectedColor, 1);
+}
+
+void toolbarSelectTool(struct widget *w) {
+    widgetSetSelected(&toolbar, TOOLBAR_FIRST_TOOL + selectedTool, 0);
+    selectedTool = w->arg;
+    widgetSetSelected(&toolbar, TOOLBAR_FIRST_TOOL + selectedTool, 1);
+}
+
+void toolbarClear(struct widget *w __attribute__((unused))) {
+    initializeCanvas(&mainCanvas);
+}
+
+void toolbarSmaller(struct widget *w __attribute__((unused))) {
+    setBrushSize(brushSize - 1);
+}
+
+void toolbarBigger(struct widget *w __attribute__((unused))) {
+    setBrushSize(brushSize + 1);
+}
+
+void toolbarInit(void) {
+    for (int j = 0; j < TOOLBAR_BUTTONS; j++) {
+        struct widget *w = &toolbarWidgets[j];
+
+        memset(w, 0, sizeof(*w));
+        w->y = TOOLBARSTARTY;
+        w->x = TOOLBARSTARTX + 3 * j;
+        w->h = w->w = 3;
+        w->hoverable = 1;
+        if (j < TOOLBAR_FIRST_TOOL) {
+            w->color = j;
+            snprintf(w->icon, sizeof(w->icon), " ");
+            w->onPress = toolbarSelectColor;
+            w->arg = j;
+            w->selected = j == selectedColor;
+            continue;
+        }
+
+        w->color = 7;
+        snprintf(w->icon, sizeof(w->icon), "%s", toolbarIcons[j - TOOLBAR_FIRST_TOOL]);
+        if (j < TOOLBAR_FIRST_TOOL + TOOL_COUNT) {
+            w->onPress = toolbarSelectTool;
+            w->arg = j - TOOLBAR_FIRST_TOOL;
+            w->selected = w->arg == selectedTool;
+        } else if (j == TOOLBAR_CLEAR) {
+            w->onPress = toolbarClear;
+        } else if (j == TOOLBAR_SMALLER) {
+            w->onPress = toolbarSmaller;
+        } else if (j == TOOLBAR_BIGGER) {
+            w->onPress = toolbarBigger;
+        } else if (j == TOOLBAR_SIZE) {
+            w->hoverable = 0;
+        }
+    }
+    if (widgetLayerInit(&toolbar, toolbarWidgets, TOOLBAR_BUTTONS) == -1) exit(1);
+    setBrushSize(brushSize);
+}
+
+void toolbarRefreshScreen() {
+    widgetLayerHover(&toolbar, MOUSEY, MOUSEX);
+    widgetLayerRefresh(&toolbar);
+}
+
+/* ========================= Words  ======================== */
+
+/* The word list is a plain text file, one word per line. Next to it we keep
+ * an index file (<dict>.idx) holding the offset and length of every word, so
+ * that both files can simply be mmap()ed at startup without parsing. The
+ * index is rebuilt whenever the dictionary size or mtime (to the
+ * nanosecond) changes, and kept in memory only when it can't be written. */
+
+#define WORD_MAX_LEN 64
+#define WORD_CLOSE_DISTANCE 2
+#define WORD_INDEX_MAGIC "TPWIDX2"
+
+struct wordIndexHeader {
+    char magic[8];
+    uint32_t count;
+    uint32_t dictMtimeNsec;
+    uint64_t dictSize;
+    int64_t dictMtime;
+};
+
+struct wordIndexEntry {
+    uint32_t off;
+    uint32_t len;
+};
+
+struct wordList {
+    const char *data;                     /* mmap()ed dictionary */
+    size_t dataLen;
+    const struct wordIndexEntry *entries; /* into idxMap, or malloc()ed if NULL */
+    uint32_t count;
+    void *idxMap;
+    size_t idxLen;
+};
+
+#define WORDLIST_INIT {NULL, 0, NULL, 0, NULL, 0}
+
+struct wordList mainWordList = WORDLIST_INIT;
+
+/* Scan the dictionary for its words, one per line, skipping blank lines and
+ * lines too long to be a word. On success '*entries' is a malloc()ed array
+ * of '*count' entries. Returns 0 on success, -1 on out of memory. */
+int wordIndexScan(const char *data, size_t len, struct wordIndexEntry **entries, uint32_t *count) {
+    struct wordIndexEntry *e = NULL;
+    uint32_t n = 0, cap = 0;
+    size_t i = 0;
+
+    while (i < len) {
+        size_t start = i, end;
+        while (i < len && data[i] != '\n')
+            i++;
+        end = i++;
+        while (end > start && isspace((unsigned char)data[end - 1]))
+            end--;
+        while (start < end && isspace((unsigned char)data[start]))
+            start++;
+        if (end == start || end - start > WORD_MAX_LEN) continue;
+        if (n == cap) {
+            struct wordIndexEntry *grown;
+            cap = cap ? cap * 2 : 1024;
+            if ((grown = realloc(e, cap * sizeof(*e))) == NULL) {
+                free(e);
+                return -1;
             }
-            if (toolbarPressed[j] && i == 2) toolbarPressed[j] = 0;
+            e = grown;
         }
-        printf("\x1b[0m");
+        e[n].off = start;
+        e[n].len = end - start;
+        n++;
     }
-    fflush(stdout);
+    *entries = e;
+    *count = n;
+    return 0;
+}
+
+/* Write the index of the dictionary described by 'st' to 'idxPath'. The
+ * index is written to a temporary file and renamed in place, so a concurrent
+ * reader never sees a truncated one. Returns 0 on success, -1 on error. */
+int wordIndexBuild(const struct wordIndexEntry *entries, uint32_t count, const struct stat *st,
+                   const char *idxPath) {
+    struct wordIndexHeader hdr;
+    char tmpPath[4096];
+    FILE *fp;
+
+    if (snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", idxPath) >= (int)sizeof(tmpPath)) return -1;
+    if ((fp = fopen(tmpPath, "wb")) == NULL) return -1;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, WORD_INDEX_MAGIC, sizeof(WORD_INDEX_MAGIC));
+    hdr.count = count;
+    hdr.dictSize = st->st_size;
+    hdr.dictMtime = st->st_mtim.tv_sec;
+    hdr.dictMtimeNsec = st->st_mtim.tv_nsec;
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) goto failed;
+    if (fwrite(entries, sizeof(*entries), count, fp) != count) goto failed;
+    if (fclose(fp) != 0) {
+        unlink(tmpPath);
+        return -1;
+    }
+    if (rename(tmpPath, idxPath) == -1) {
+        unlink(tmpPath);
+        return -1;
+    }
+    return 0;
+
+failed:
+    fclose(fp);
+    unlink(tmpPath);
+    return -1;
+}
+
+/* Map the index at 'idxPath' and check it matches the dictionary already
+ * mapped in 'wl': every entry must be a word inside it, so that a corrupt
+ * index can't make wordListGet() read past the end of the dictionary.
+ * Returns 0 on success, -1 if it is missing, stale or invalid. */
+int wordIndexMap(struct wordList *wl, const struct stat *st, const char *idxPath) {
+    const struct wordIndexHeader *hdr;
+    const struct wordIndexEntry *entries;
+    struct stat ist;
+    void *map;
+    int fd;
+
+    if ((fd = open(idxPath, O_RDONLY)) == -1) return -1;
+    if (fstat(fd, &ist) == -1 || (size_t)ist.st_size < sizeof(*hdr)) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, ist.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    hdr = map;
+    entries = (const struct wordIndexEntry *)(hdr + 1);
+    if (memcmp(hdr->magic, WORD_INDEX_MAGIC, sizeof(WORD_INDEX_MAGIC)) != 0 ||
+        hdr->dictSize != (uint64_t)st->st_size ||
+        hdr->dictMtime != (int64_t)st->st_mtim.tv_sec ||
+        hdr->dictMtimeNsec != (uint32_t)st->st_mtim.tv_nsec ||
+        (size_t)ist.st_size != sizeof(*hdr) + (size_t)hdr->count * sizeof(struct wordIndexEntry))
+        goto invalid;
+    for (uint32_t i = 0; i < hdr->count; i++) {
+        if (entries[i].len == 0 || entries[i].len > WORD_MAX_LEN ||
+            (size_t)entries[i].off + entries[i].len > wl->dataLen)
+            goto invalid;
+    }
+
+    wl->idxMap = map;
+    wl->idxLen = ist.st_size;
+    wl->entries = entries;
+    wl->count = hdr->count;
+    return 0;
+
+invalid:
+    munmap(map, ist.st_size);
+    return -1;
+}
+
+/* Load the dictionary at 'path', building its index on first use.
+ * Returns 0 on success, -1 on error. */
+int wordListLoad(struct wordList *wl, const char *path) {
+    char idxPath[4096];
+    struct wordIndexEntry *entries;
+    uint32_t count;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if (snprintf(idxPath, sizeof(idxPath), "%s.idx", path) >= (int)sizeof(idxPath)) return -1;
+    if ((fd = open(path, O_RDONLY)) == -1) return -1;
+    if (fstat(fd, &st) == -1 || st.st_size == 0 || st.st_size > UINT32_MAX) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    wl->data = map;
+    wl->dataLen = st.st_size;
+    if (wordIndexMap(wl, &st, idxPath) == 0) return 0;
+    if (wordIndexScan(wl->data, wl->dataLen, &entries, &count) == -1) goto failed;
+    if (count == 0) {
+        free(entries);
+        goto failed;
+    }
+
+    /* The index file only makes the next startup faster. If it can't be
+     * written, e.g. next to a dictionary in a read-only directory, keep
+     * using the one we just built in memory. */
+    if (wordIndexBuild(entries, count, &st, idxPath) == 0 && wordIndexMap(wl, &st, idxPath) == 0) {
+        free(entries);
+        return 0;
+    }
+    wl->entries = entries;
+    wl->count = count;
+    return 0;
+
+failed:
+    munmap(map, st.st_size);
+    wl->data = NULL;
+    wl->dataLen = 0;
+    return -1;
+}
+
+void wordListFree(struct wordList *wl) {
+    if (wl->idxMap)
+        munmap(wl->idxMap, wl->idxLen);
+    else
+        free((void *)wl->entries);
+    if (wl->data) munmap((void *)wl->data, wl->dataLen);
+    *wl = (struct wordList)WORDLIST_INIT;
+}
+
+/* A deck draws words from a word list at random without repeating any of
+ * them until the whole list has been used. It is a Fisher-Yates shuffle
+ * done one draw at a time: perm[i] holds the index stored in slot i plus
+ * one, and zero means "i itself", so a fresh (calloc()ed) deck needs no
+ * initialization pass and each draw is O(1). */
+struct wordDeck {
+    uint32_t *perm;
+    uint32_t remaining;
+    uint32_t count;
+    uint64_t rng;
+};
+
+int wordDeckInit(struct wordDeck *d, const struct wordList *wl, uint64_t seed) {
+    d->perm = calloc(wl->count, sizeof(uint32_t));
+    if (d->perm == NULL) return -1;
+    d->count = d->remaining = wl->count;
+    d->rng = seed ? seed : 0x9e3779b97f4a7c15ULL;
+    return 0;
+}
+
+void wordDeckFree(struct wordDeck *d) {
+    free(d->perm);
+    d->perm = NULL;
+    d->count = d->remaining = 0;
+}
+
+/* xorshift64* */
+uint64_t wordDeckRandom(struct wordDeck *d) {
+    d->rng ^= d->rng >> 12;
+    d->rng ^= d->rng << 25;
+    d->rng ^= d->rng >> 27;
+    return d->rng * 0x2545f4914f6cdd1dULL;
+}
+
+/* Return the index of the next word, or -1 if the deck is empty. */
+int64_t wordDeckDraw(struct wordDeck *d) {
+    uint32_t j, last, vj, vlast;
+
+    if (d->count == 0) return -1;
+    if (d->remaining == 0) {
+        /* Every word has been drawn: start a new cycle. */
+        memset(d->perm, 0, d->count * sizeof(uint32_t));
+        d->remaining = d->count;
+    }
+    j = wordDeckRandom(d) % d->remaining;
+    last = d->remaining - 1;
+    vj = d->perm[j] ? d->perm[j] - 1 : j;
+    vlast = d->perm[last] ? d->perm[last] - 1 : last;
+    d->perm[j] = vlast + 1;
+    d->remaining--;
+    return vj;
+}
+
+const char *wordListGet(const struct wordList *wl, uint32_t i, int *len) {
+    *len = wl->entries[i].len;
+    return wl->data + wl->entries[i].off;
+}
+
+/* Case insensitive Levenshtein distance between a and b, computed only
+ * inside the diagonal band of width 2*k+1 and abandoned as soon as a whole
+ * row exceeds k. Returns the distance, or k+1 if it is larger than k. */
+int wordDistance(const char *a, int la, const char *b, int lb, int k) {
+    int rows[2][WORD_MAX_LEN + 1];
+    int *prev = rows[0], *cur = rows[1], *tmp;
+    int far = k + 1;
+
+    if (la > WORD_MAX_LEN || lb > WORD_MAX_LEN) return far;
+    if (la - lb > k || lb - la > k) return far;
+
+    for (int j = 0; j <= lb; j++)
+        prev[j] = j <= k ? j : far;
+
+    for (int i = 1; i <= la; i++) {
+        int lo = i - k > 1 ? i - k : 1;
+        int hi = i + k < lb ? i + k : lb;
+        int rowMin = far;
+
+        cur[0] = i <= k ? i : far;
+        if (lo > 1) cur[lo - 1] = far;
+        if (lo == 1) rowMin = cur[0];
+        for (int j = lo; j <= hi; j++) {
+            int v = prev[j - 1] + (tolower((unsigned char)a[i - 1]) != tolower((unsigned char)b[j - 1]));
+            if (prev[j] + 1 < v) v = prev[j] + 1;
+            if (cur[j - 1] + 1 < v) v = cur[j - 1] + 1;
+            if (v > far) v = far;
+            cur[j] = v;
+            if (v < rowMin) rowMin = v;
+        }
+        if (hi < lb) cur[hi + 1] = far;
+        if (rowMin > k) return far;
+
+        tmp = prev;
+        prev = cur;
+        cur = tmp;
+    }
+    return prev[lb];
+}
+
+enum GUESS_RESULT {
+    GUESS_WRONG = 0,
+    GUESS_CLOSE,
+    GUESS_CORRECT
+};
+
+/* Compare a guess with the secret word, ignoring case and surrounding
+ * blanks. */
+int wordCheckGuess(const char *secret, int slen, const char *guess) {
+    int glen = strlen(guess), d;
+
+    while (glen > 0 && isspace((unsigned char)*guess)) {
+        guess++;
+        glen--;
+    }
+    while (glen > 0 && isspace((unsigned char)guess[glen - 1]))
+        glen--;
+    if (glen == 0) return GUESS_WRONG;
+
+    d = wordDistance(secret, slen, guess, glen, WORD_CLOSE_DISTANCE);
+    if (d == 0) return GUESS_CORRECT;
+    if (d <= WORD_CLOSE_DISTANCE) return GUESS_CLOSE;
+    return GUESS_WRONG;
+}
+
+/* ========================= Room  ======================== */
+
+#define ROUND_MS 80000 /* Length of a round. */
+#define HINT_MS 20000  /* Interval between two revealed letters. */
+#define IDLE_MS 45000  /* Skip the turn after this long without input. */
+#define CLOCK_MS 1000  /* Status bar countdown refresh. */
+
+struct room {
+    struct wordDeck deck;
+    const char *word; /* Not null terminated, points into the word list. */
+    int wordLen;
+    char hint[WORD_MAX_LEN + 1];
+    int hiddenLetters;
+    int round;
+    uint64_t roundEndMs;
+    char guess[WORD_MAX_LEN + 1];
+    int guessLen;
+    int drawerView; /* Show the word to draw instead of the hint and guess. */
+    char message[32];
+    struct timer roundTimer, hintTimer, idleTimer, clockTimer;
+};
+
+struct room mainRoom;
+
+int STATUSY, STATUSX;
+
+void roomStartRound(struct room *r);
+
+void roomRoundExpired(void *arg) {
+    struct room *r = arg;
+    snprintf(r->message, sizeof(r->message), "time's up!");
+    roomStartRound(r);
+}
+
+void roomIdleExpired(void *arg) {
+    struct room *r = arg;
+    snprintf(r->message, sizeof(r->message), "idle, turn skipped");
+    roomStartRound(r);
+}
+
+/* Reveal one more random letter of the hint. */
+void roomRevealHint(void *arg) {
+    struct room *r = arg;
+    int n;
+
+    if (r->hiddenLetters <= 1) return;
+    n = wordDeckRandom(&r->deck) % r->hiddenLetters;
+    for (int i = 0; i < r->wordLen; i++) {
+        if (r->hint[i] != '_') continue;
+        if (n-- == 0) {
+            r->hint[i] = r->word[i];
+            break;
+        }
+    }
+    r->hiddenLetters--;
+    if (r->hiddenLetters > 1) timerArm(&mainTimers, &r->hintTimer, HINT_MS, roomRevealHint, r);
+}
+
+/* Nothing to do but wake up the main loop so the countdown is redrawn. */
+void roomClockTick(void *arg) {
+    struct room *r = arg;
+    timerArm(&mainTimers, &r->clockTimer, CLOCK_MS, roomClockTick, r);
+}
+
+/* Draw the next word and (re)arm the round timers. */
+void roomStartRound(struct room *r) {
+    int64_t i = wordDeckDraw(&r->deck);
+    if (i < 0) {
+        r->word = NULL;
+        r->wordLen = 0;
+        return;
+    }
+    r->word = wordListGet(&mainWordList, i, &r->wordLen);
+    r->hiddenLetters = 0;
+    for (int j = 0; j < r->wordLen; j++) {
+        if (isspace((unsigned char)r->word[j])) {
+            r->hint[j] = ' ';
+        } else {
+            r->hint[j] = '_';
+            r->hiddenLetters++;
+        }
+    }
+    r->hint[r->wordLen] = '\0';
+    r->drawerView = 0; /* Never show a new word before it is asked for. */
+    r->round++;
+    r->roundEndMs = timeNowMs() + ROUND_MS;
+
+    timerArm(&mainTimers, &r->roundTimer, ROUND_MS, roomRoundExpired, r);
+    timerArm(&mainTimers, &r->hintTimer, HINT_MS, roomRevealHint, r);
+    timerArm(&mainTimers, &r->idleTimer, IDLE_MS, roomIdleExpired, r);
+    timerArm(&mainTimers, &r->clockTimer, CLOCK_MS, roomClockTick, r);
+}
+
+int roomInit(struct room *r, uint64_t seed) {
+    memset(r, 0, sizeof(*r));
+    if (mainWordList.count == 0) return -1;
+    if (wordDeckInit(&r->deck, &mainWordList, seed) == -1) return -1;
+    roomStartRound(r);
+    return 0;
+}
+
+void roomFree(struct room *r) {
+    timerCancel(&mainTimers, &r->roundTimer);
+    timerCancel(&mainTimers, &r->hintTimer);
+    timerCancel(&mainTimers, &r->idleTimer);
+    timerCancel(&mainTimers, &r->clockTimer);
+    wordDeckFree(&r->deck);
+}
+
+/* Called on every input event: postpone the idle timeout. */
+void roomTouch(struct room *r) {
+    if (timerArmed(&r->idleTimer))
+        timerArm(&mainTimers, &r->idleTimer, IDLE_MS, roomIdleExpired, r);
+}
+
+void roomSubmitGuess(struct room *r) {
+    r->guess[r->guessLen] = '\0';
+    if (r->word == NULL) {
+        r->guessLen = 0;
+        return;
+    }
+    switch (wordCheckGuess(r->word, r->wordLen, r->guess)) {
+    case GUESS_CORRECT:
+        snprintf(r->message, sizeof(r->message), "correct!");
+        roomStartRound(r);
+        break;
+    case GUESS_CLOSE:
+        snprintf(r->message, sizeof(r->message), "close!");
+        break;
+    default:
+        snprintf(r->message, sizeof(r->message), "wrong");
+        break;
+    }
+    r->guessLen = 0;
+}
+
+#define STATUS_WIDTH (3 * TOOLBAR_BUTTONS)
+
+void statusRefreshScreen(struct room *r) {
+    char line[STATUS_WIDTH + 1];
+    int n, left;
+
+    /* Longer lines are simply truncated to the status bar width. */
+    if (r->word) {
+        left = r->roundEndMs > timeNowMs() ? (r->roundEndMs - timeNowMs() + 999) / 1000 : 0;
+        if (r->drawerView)
+            n = snprintf(line, sizeof(line), " R%d %2ds Draw: %.*s (Tab hides) %s",
+                         r->round, left, r->wordLen, r->word, r->message);
+        else
+            n = snprintf(line, sizeof(line), " R%d %2ds [%s] Guess: %.*s_ %s",
+                         r->round, left, r->hint, r->guessLen, r->guess, r->message);
+    } else {
+        n = snprintf(line, sizeof(line), " No word list loaded");
+    }
+    if (n < 0) line[0] = '\0';
+    printf("\x1b[%d;%dH", STATUSY, STATUSX);
+    termColor(15, 0);
+    printf("%-*s", STATUS_WIDTH, line);
 }
 
 /* ============================= Terminal update ============================ */
@@ -615,8 +2502,11 @@ void drawMouse(void) {
 }
 
 void termRefreshScreen(void) {
+    termBeginFrame();
     canvasRefreshScreen(&mainCanvas);
     toolbarRefreshScreen();
+    statusRefreshScreen(&mainRoom);
+    termEndFrame();
 }
 
 /* ========================= Term events handling  ======================== */
@@ -625,9 +2515,14 @@ void termRefreshScreen(void) {
  * is typing stuff on the terminal. */
 void termProcessKeypress(int fd) {
     int c = termReadKey(fd);
-    int cy, cx, toolbarBtnPressed, old_color;
+    int cy, cx, old_color;
+    if (c != KEY_NULL) roomTouch(&mainRoom);
     switch (c) {
     case ENTER:
+        if (mainRoom.guessLen > 0 && !mainRoom.drawerView) roomSubmitGuess(&mainRoom);
+        break;
+    case TAB:
+        mainRoom.drawerView = !mainRoom.drawerView;
         break;
 
     case CTRL_C:
@@ -647,6 +2542,7 @@ void termProcessKeypress(int fd) {
     case BACKSPACE:
     case CTRL_H:
     case DEL_KEY:
+        if (mainRoom.guessLen > 0) mainRoom.guessLen--;
         break;
     case PAGE_UP:
     case PAGE_DOWN:
@@ -665,57 +2561,40 @@ void termProcessKeypress(int fd) {
 
     case LMB_DOWN:
     case LMB_PRESSED_MOVE:
-        toolbarBtnPressed = (MOUSEX - TOOLBARSTARTX) / 3;
-        if (TOOLBARSTARTY <= MOUSEY && MOUSEY <= TOOLBARENDY && toolbarBtnPressed >= 0 && toolbarBtnPressed < 22) {
-            if (toolbarBtnPressed != 20)
-                toolbarPressed[toolbarBtnPressed] = 1;
-            if (toolbarBtnPressed < 16) {
-                for (int i = 0; i < 16; i++)
-                    toolbarSelected[i] = 0;
-                selectedColor = toolbarBtnPressed;
-                toolbarSelected[toolbarBtnPressed] = 1;
-            } else if (toolbarBtnPressed == 16) {
-                fillMode = 0;
-                toolbarSelected[17] = 0;
-                toolbarSelected[toolbarBtnPressed] = 1;
-            } else if (toolbarBtnPressed == 17) {
-                fillMode = 1;
-                toolbarSelected[16] = 0;
-                toolbarSelected[toolbarBtnPressed] = 1;
-            } else if (toolbarBtnPressed == 18) {
-                initializeCanvas(&mainCanvas);
-            } else if (toolbarBtnPressed == 19) {
-                brushSize--;
-                if (brushSize < minBrushSize) brushSize = minBrushSize;
-            } else if (toolbarBtnPressed == 21) {
-                brushSize++;
-                if (brushSize > maxBrushSize) brushSize = maxBrushSize;
-            }
-        }
-        if (translateCanvasPosition(&mainCanvas, MOUSEY, MOUSEX, &cy, &cx) != -1) {
-            if (fillMode) {
+        widgetLayerPress(&toolbar, MOUSEY, MOUSEX);
+        if (shapeDragging) {
+            /* Keep following the mouse even outside of the canvas. */
+            translateCanvasPosition(&mainCanvas, MOUSEY, MOUSEX, &cy, &cx);
+            shapeUpdate(&mainCanvas, cy, cx);
+        } else if (translateCanvasPosition(&mainCanvas, MOUSEY, MOUSEX, &cy, &cx) != -1) {
+            if (selectedTool == TOOL_FILL) {
                 old_color = getPixel(&mainCanvas, cy, cx);
                 if (old_color != selectedColor)
                     fillCanvas(&mainCanvas, cy, cx, old_color, selectedColor);
-            } else {
+            } else if (selectedTool == TOOL_BRUSH) {
                 for (int i = 0; i < 9; i++) {
                     for (int j = 0; j < 9; j++) {
                         if (brushTemplates[brushSize - 1][i][j])
                             setPixel(&mainCanvas, cy - 4 + i, cx - 4 + j, selectedColor);
                     }
                 }
+            } else if (c == LMB_DOWN) {
+                shapeBegin(&mainCanvas, selectedTool, cy, cx);
             }
         }
         break;
+    case LMB_UP:
+        if (shapeDragging) shapeCommit(&mainCanvas);
+        break;
     case SCROLL_UP:
-        brushSize++;
-        if (brushSize > maxBrushSize) brushSize = maxBrushSize;
+        setBrushSize(brushSize + 1);
         break;
     case SCROLL_DOWN:
-        brushSize--;
-        if (brushSize < minBrushSize) brushSize = minBrushSize;
+        setBrushSize(brushSize - 1);
         break;
     default:
+        if (c < 128 && isprint(c) && !mainRoom.drawerView && mainRoom.guessLen < WORD_MAX_LEN)
+            mainRoom.guess[mainRoom.guessLen++] = c;
         break;
     }
 }
@@ -728,47 +2607,71 @@ void updateWindowSize(void) {
     }
 }
 
+volatile sig_atomic_t WINRESIZED = 0;
+
+/* Only flag the resize: the main loop, whose poll() is interrupted by the
+ * signal, picks it up in checkWindowResize(). */
 void handleSigWinCh(int unused __attribute__((unused))) {
+    WINRESIZED = 1;
+}
+
+/* Apply a pending resize and mark everything to be drawn again. Returns 1
+ * if the window was resized since the last call, 0 otherwise. */
+int checkWindowResize(void) {
+    if (!WINRESIZED) return 0;
+    WINRESIZED = 0;
     updateWindowSize();
-    termRefreshScreen();
+    canvasMarkAll(&mainCanvas);
+    widgetMarkAll(&toolbar);
+    return 1;
 }
 
 void initTerm(void) {
+    /* Frames are written with a single write() whenever possible. */
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
     updateWindowSize();
     signal(SIGWINCH, handleSigWinCh);
 }
 
-void initClient(void) {
+void initClient(const char *wordsPath) {
     initTerm();
     enableRawMode(STDIN_FILENO);
+    termProbeCapabilities(STDIN_FILENO, STDOUT_FILENO);
 
-    mainCanvas.sizex = 82;
-    mainCanvas.sizey = 62;
+    mainCanvas.sizex = CANVAS_WIDTH + 2;
+    mainCanvas.sizey = CANVAS_HEIGHT + 2;
     mainCanvas.startx = (NCOLS - mainCanvas.sizex) / 2;
     mainCanvas.starty = 1;
     initializeCanvas(&mainCanvas);
 
     TOOLBARSTARTY = 64;
     TOOLBARENDY = 66;
-    TOOLBARSTARTX = (NCOLS - 3 * 22) / 2;
+    TOOLBARSTARTX = (NCOLS - 3 * TOOLBAR_BUTTONS) / 2;
+    toolbarInit();
+
+    STATUSY = TOOLBARENDY + 2;
+    STATUSX = TOOLBARSTARTX;
+
+    srand(time(NULL));
+    timerWheelInit(&mainTimers, timeNowMs());
+    if (wordListLoad(&mainWordList, wordsPath) == 0)
+        roomInit(&mainRoom, ((uint64_t)time(NULL) << 32) ^ getpid());
 
     write(STDOUT_FILENO, "\x1b[2J", 4); /* Clear screen */
     write(STDOUT_FILENO, "\x1b[H", 3);  /* Move cursor to home */
 
     /* Enable Mouse reporting*/
-    write(STDOUT_FILENO, "\x1b[?1006h", 8);
-    write(STDOUT_FILENO, "\x1b[?1003h", 8);
-    write(STDOUT_FILENO, "\x1b[?1015h", 8);
+    termSetMouseReporting(1);
 
     /* Draw background */
-    printf("\x1b[48;5;7m\x1b[38;5;8m");
+    termColor(8, 7);
     for (int i = 0; i < NROWS * NCOLS; i++) {
         if (rand() % 2)
             printf("🮘");
         else
             printf("🮙");
     }
-    printf("\x1b[0m");
+    termResetColor();
     fflush(stdout);
 }
 
@@ -780,21 +2683,179 @@ void finalizeClient() {
     write(STDOUT_FILENO, "\x1b[?25h", 6); /* Show cursor. */
 
     /* Disable mouse reporting */
-    write(STDOUT_FILENO, "\x1b[?1006l", 8);
-    write(STDOUT_FILENO, "\x1b[?1003l", 8);
-    write(STDOUT_FILENO, "\x1b[?1015l", 8);
+    termSetMouseReporting(0);
 
     free(mainCanvas.colorBuf);
+    free(mainCanvas.overlay);
+    roomFree(&mainRoom);
+    widgetLayerFree(&toolbar);
+    wordListFree(&mainWordList);
+    timelapseClose(&mainTimelapse);
+}
+
+void playbackRefreshStatus(double speed, int paused, const char *msg) {
+    char line[CANVAS_WIDTH + 3];
+    int n;
+
+    n = snprintf(line, sizeof(line), " Frame %u | Speed x%g | %s", mainTimelapse.frames, speed,
+                 msg ? msg : (paused ? "paused" : "+/- speed, space pause, q quit"));
+    if (n < 0) line[0] = '\0';
+    printf("\x1b[%d;%dH", STATUSY, STATUSX);
+    termColor(15, 0);
+    printf("%-*s", mainCanvas.sizex, line);
 }
 
-int main() {
-    initClient();
+/* Replay the timelapse at 'path' in the terminal. Returns when the user
+ * quits. */
+void playTimelapse(const char *path, double speed) {
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    struct timelapseFrame f;
+    unsigned char *pixels;
+    uint32_t lastMs = 0;
+    int paused = 0, ret;
+
+    if (timelapseOpenRead(&mainTimelapse, path) == -1) {
+        perror("Unable to open the timelapse");
+        exit(1);
+    }
+    f.data = malloc(2 * (size_t)mainTimelapse.sizey * mainTimelapse.sizex);
+    pixels = malloc((size_t)mainTimelapse.sizey * mainTimelapse.sizex);
+    if (f.data == NULL || pixels == NULL) exit(1);
+
+    initTerm();
+    enableRawMode(STDIN_FILENO);
+    atexit(finalizeClient); /* Only once there is a terminal mode to restore. */
+    termProbeCapabilities(STDIN_FILENO, STDOUT_FILENO);
+    mainCanvas.sizey = mainTimelapse.sizey + 2;
+    mainCanvas.sizex = mainTimelapse.sizex + 2;
+    mainCanvas.startx = (NCOLS - mainCanvas.sizex) / 2;
+    mainCanvas.starty = 1;
+    mainCanvas.showCursor = 0;
+    initializeCanvas(&mainCanvas);
+    STATUSY = mainCanvas.starty + mainCanvas.sizey;
+    STATUSX = mainCanvas.startx;
+
+    write(STDOUT_FILENO, "\x1b[2J", 4); /* Clear screen */
+    write(STDOUT_FILENO, "\x1b[?25l", 6); /* Hide cursor. */
+
+    while ((ret = timelapseReadFrame(&mainTimelapse, &f)) == 1) {
+        uint64_t deadline = timeNowMs() + timelapseDelayMs(lastMs, f.ms, speed);
+        uint64_t now;
+
+        while (paused || (now = timeNowMs()) < deadline) {
+            termBeginFrame();
+            playbackRefreshStatus(speed, paused, NULL);
+            termEndFrame();
+            int ready = poll(&pfd, 1, paused ? -1 : (int)(deadline - now));
+            if (checkWindowResize()) {
+                termBeginFrame();
+                canvasRefreshScreen(&mainCanvas);
+                termEndFrame();
+            }
+            if (ready <= 0) continue;
+            switch (termReadKey(STDIN_FILENO)) {
+            case '+':
+            case ARROW_UP:
+            case ARROW_RIGHT:
+                if (speed < 64) speed *= 2;
+                break;
+            case '-':
+            case ARROW_DOWN:
+            case ARROW_LEFT:
+                if (speed > 1.0 / 16) speed /= 2;
+                break;
+            case ' ':
+                paused = !paused;
+                break;
+            case 'q':
+            case ESC:
+            case CTRL_C:
+            case CTRL_Q:
+                goto done;
+            }
+        }
+        lastMs = f.ms;
+
+        timelapseUnpackFrame(&f, pixels);
+        for (int n = 0; n < f.h * f.w; n++)
+            setPixel(&mainCanvas, f.y + n / f.w, f.x + n % f.w, pixels[n]);
+        termBeginFrame();
+        canvasRefreshScreen(&mainCanvas);
+        termEndFrame();
+    }
+
+    const char *msg = ret == 0 ? "end, press any key" : "corrupted file, press any key";
+    do {
+        termBeginFrame();
+        if (checkWindowResize()) canvasRefreshScreen(&mainCanvas);
+        playbackRefreshStatus(speed, 0, msg);
+        termEndFrame();
+    } while (poll(&pfd, 1, -1) <= 0 || termReadKey(STDIN_FILENO) == KEY_NULL);
+
+done:
+    free(f.data);
+    free(pixels);
+}
+
+int main(int argc, char **argv) {
+    const char *wordsPath = "words.txt", *recordPath = NULL, *playPath = NULL;
+    const char *exportPath = NULL, *gifPath = NULL;
+    double speed = 1;
+    int scale = 4;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+            wordsPath = argv[++i];
+        } else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+            recordPath = argv[++i];
+        } else if (!strcmp(argv[i], "-p") && i + 1 < argc) {
+            playPath = argv[++i];
+        } else if (!strcmp(argv[i], "-e") && i + 2 < argc) {
+            exportPath = argv[++i];
+            gifPath = argv[++i];
+        } else if (!strcmp(argv[i], "-s") && i + 1 < argc && atof(argv[i + 1]) > 0) {
+            speed = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-z") && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            scale = atoi(argv[++i]);
+        } else {
+            fprintf(stderr,
+                    "Usage: %s [-w wordlist] [-r timelapse]\n"
+                    "       %s -p timelapse [-s speed]\n"
+                    "       %s -e timelapse out.gif [-s speed] [-z zoom]\n",
+                    argv[0], argv[0], argv[0]);
+            exit(1);
+        }
+    }
+
+    if (exportPath) {
+        if (timelapseExportGif(exportPath, gifPath, speed, scale) == -1) {
+            fprintf(stderr, "Unable to export %s to %s\n", exportPath, gifPath);
+            exit(1);
+        }
+        return 0;
+    }
+    if (playPath) {
+        playTimelapse(playPath, speed);
+        return 0;
+    }
+    if (recordPath && timelapseOpen(&mainTimelapse, recordPath, CANVAS_HEIGHT, CANVAS_WIDTH) == -1) {
+        perror("Unable to open the timelapse");
+        exit(1);
+    }
+
+    initClient(wordsPath);
     atexit(finalizeClient);
 
-    termProcessKeypress(STDIN_FILENO);
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
     while (1) {
         termRefreshScreen();
-        termProcessKeypress(STDIN_FILENO);
+        /* Sleep until there is input or the next timer is due. */
+        int ready = poll(&pfd, 1, timerWheelTimeout(&mainTimers, timeNowMs()));
+        if (ready == -1 && errno != EINTR) exit(1);
+        checkWindowResize();
+        timerWheelAdvance(&mainTimers, timeNowMs());
+        if (ready > 0) termProcessKeypress(STDIN_FILENO);
+        timelapseRecord(&mainTimelapse, &mainCanvas);
     }
     return 0;
-}
\ No newline at end of file
+}